@@ -1,11 +1,30 @@
-#include <stdio.h> /* fprintf() */
-#include <stdlib.h> /* exit() */
-#include <string.h> /* strlen() */
+#include <stdio.h> /* fprintf(), sscanf(), snprintf(), fopen() */
+#include <stdlib.h> /* exit(), abs(), strtoul(), qsort() */
+#include <string.h> /* strlen(), strerror(), strdup(), strchr() */
+#include <stdint.h> /* uint64_t */
+#include <errno.h> /* errno */
 #include <fcntl.h> /* open() */
-#include <unistd.h> /* read(), write(), lseek(), close(), sleep() */
+#include <unistd.h> /* read(), pread(), write(), close(), getopt() */
+#include <signal.h> /* sigprocmask() */
+#include <time.h> /* clock_gettime(), clock_nanosleep() */
+#include <pthread.h> /* pthread_create(), pthread_join(), pthread_cond_wait() */
+#include <sys/ioctl.h> /* ioctl() */
+#include <sys/epoll.h> /* epoll_create1(), epoll_ctl(), epoll_wait() */
+#include <sys/timerfd.h> /* timerfd_create(), timerfd_settime() */
+#include <sys/signalfd.h> /* signalfd() */
+#include <linux/iio/events.h> /* struct iio_event_data */
 
-#define DHT11_TEMP_FILE_PATH "/sys/bus/iio/devices/iio:device0/in_temp_input"
-#define DHT11_HUMI_FILE_PATH "/sys/bus/iio/devices/iio:device0/in_humidityrelative_input"
+#include "app_io.h"
+#include "app_fake.h"
+
+#ifndef IIO_GET_EVENT_FD_IOCTL /* Not in the uapi headers of older kernels */
+#define IIO_GET_EVENT_FD_IOCTL _IOR('i', 0x90, int)
+#endif
+
+/* Defaults, see config below */
+#define DHT11_IIO_DEVICE "iio:device0"
+#define IIO_DEV_DIR_PATH "/dev"
+#define IIO_SYSFS_DIR_PATH "/sys/bus/iio/devices"
 #define RYGLEDS_FILE_PATH "/sys/class/RYGleds_class/RYGleds_dev/temperature"
 #define BUZZER_FILE_PATH "/sys/class/buzzer_class/buzzer_dev/temperature"
 #define LCD1602_TEMP_FILE_PATH "/sys/devices/platform/soc/soc:my_lcd1602/temperature"
@@ -13,163 +32,1163 @@
 
 #define BUF_SIZE 1024
 
-int main(void)
+/* Fake mode: a step per validity window, or a fast one for the benchmark */
+#define FAKE_DIR_PATH "/dev/shm"
+#define FAKE_PERIOD 2000000 /* us */
+#define BENCH_PERIOD 1000 /* us */
+#define BENCH_MAX_SAMPLES 100000 /* Per stage */
+
+/* The driver samples in the background and wakes us up on a band change */
+#define DHT11_SAMPLING_FREQUENCY "0.5" /* Hz, one frame per 2s validity window */
+
+/* The driver serves a frame for 2s, a failed read retried sooner only gets
+ * the same answer. Retries back off in whole windows.
+ */
+#define DHT11_VALIDITY_WINDOW 2 /* s */
+#define DHT11_MAX_BACKOFF 32 /* s */
+
+/* The LCD shows the exact values and humidity has no events, so it gets every
+ * frame. Its deadband and min_interval keep the redraws down, the LEDs and
+ * the buzzer drop readings in the same band.
+ */
+#define LCD1602_REFRESH_INTERVAL DHT11_VALIDITY_WINDOW /* s */
+
+/* Temperature bands of the threshold events and the buzzer: green up to 25,
+ * yellow up to 30, red above. LED banks can have their own.
+ */
+#define BAND_GREEN_MAX 25
+#define BAND_YELLOW_MAX 30
+
+enum band {
+	BAND_GREEN,
+	BAND_YELLOW,
+	BAND_RED,
+};
+
+/* Humidity jitters by one between frames, don't redraw the LCD for that */
+#define LCD1602_TEMP_DEADBAND 0
+#define LCD1602_HUMI_DEADBAND 1
+
+/* At most one LCD redraw per second, alerts are never held back */
+#define RYGLEDS_MIN_INTERVAL 0 /* ms */
+#define BUZZER_MIN_INTERVAL 0 /* ms */
+#define LCD1602_MIN_INTERVAL 1000 /* ms */
+
+struct reading {
+	int temperature;
+	int humidity;
+};
+
+/* Where the sensor and the sinks are, from -d, -c and -o */
+struct config {
+	const char *device;
+	const char *sample;
+	const char *sampling_frequency;
+	const char *events;
+	const char *rygleds;
+	const char *buzzer;
+	const char *lcd1602_temperature;
+	const char *lcd1602_humidity;
+};
+
+static struct config config = {
+	.rygleds = RYGLEDS_FILE_PATH,
+	.buzzer = BUZZER_FILE_PATH,
+	.lcd1602_temperature = LCD1602_TEMP_FILE_PATH,
+	.lcd1602_humidity = LCD1602_HUMI_FILE_PATH,
+};
+
+static const struct config_key {
+	const char *key;
+	const char **value;
+} config_keys[] = {
+	{ "device", &config.device },
+	{ "sample", &config.sample },
+	{ "sampling_frequency", &config.sampling_frequency },
+	{ "events", &config.events },
+	{ "rygleds", &config.rygleds },
+	{ "buzzer", &config.buzzer },
+	{ "lcd1602_temperature", &config.lcd1602_temperature },
+	{ "lcd1602_humidity", &config.lcd1602_humidity },
+};
+
+/* Latencies of one stage in benchmark mode */
+struct stage {
+	const char *name;
+	long long *samples; /* ns */
+	unsigned long count;
+};
+
+/* Every sink has its own worker thread, so a slow or failing sink never delays
+ * the others. The main thread only posts readings: a reading not yet taken by
+ * the worker is replaced by the newer one, and the worker writes it once the
+ * sink's min_interval has passed since the last write, if changed() says it
+ * matters to the sink. A failed write is reported and retried with the next
+ * reading, the fds are opened again then. Each worker has its own io_ring, the
+ * sink's files are registered with it.
+ */
+struct sink {
+	const char *name;
+	const char **paths[2]; /* Into config */
+	int fds[2];
+	int (*changed)(const struct sink *sink, const struct reading *reading);
+	int (*write)(struct sink *sink, const struct reading *reading);
+	long min_interval; /* ms */
+	struct io_ring ring;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct reading pending; /* Under lock */
+	long long posted; /* Under lock, when pending was posted */
+	int has_pending; /* Under lock */
+	int stop; /* Under lock */
+
+	struct reading last; /* Last written, only used by the worker */
+	int valid;
+	struct timespec last_write;
+	unsigned long writes, errors;
+	struct stage stage; /* From post to written */
+};
+
+static int dht11_sample_fd = -1, dht11_event_fd = -1;
+static int epoll_fd = -1, timer_fd = -1, signal_fd = -1, retry_fd = -1;
+static int event_watched;
+
+/* Sensor errors, see sensor_error() */
+static int sensor_backoff; /* s, 0 while reads succeed */
+static int retry_armed;
+static unsigned long sensor_errors;
+static struct reading last_good;
+static int have_good;
+
+/* Reads of the main thread: in_sample together with the fd that woke it up */
+static struct io_ring main_ring = { .fd = -1 };
+static int use_uring; /* -u, sysfs can't do nowait, so every request goes through io-wq and is slower */
+
+static sigset_t signal_mask;
+
+/* Fake mode and its benchmark */
+static int fake_mode;
+static struct fake fake;
+static unsigned long bench_steps;
+static struct stage stage_event = { .name = "event" }, stage_read = { .name = "read" }, stage_update = { .name = "update" };
+static unsigned long sample_reads, event_wakeups;
+
+static void close_all(void)
 {
-	int dht11_temp_fd, dht11_humi_fd, RYGleds_fd, buzzer_fd, lcd1602_temp_fd, lcd1602_humi_fd;
-	ssize_t num_read, num_write;
-	char temp_buf[BUF_SIZE], humi_buf[BUF_SIZE];
+	int *fds[] = { &signal_fd, &timer_fd, &retry_fd, &epoll_fd, &dht11_event_fd, &dht11_sample_fd };
+	size_t i;
+
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+		if (*fds[i] != -1) {
+			close(*fds[i]);
+			*fds[i] = -1;
+		}
+	}
 
-	dht11_temp_fd = open(DHT11_TEMP_FILE_PATH, O_RDONLY);
-	if (dht11_temp_fd == -1) {
-		fprintf(stderr, "Fail to open file: %s\n", DHT11_TEMP_FILE_PATH);
+	fake_destroy(&fake);
+}
 
-		exit(EXIT_FAILURE);
+static void fail(const char *what, const char *path)
+{
+	fprintf(stderr, "Fail to %s: %s\n", what, path);
+
+	close_all();
+
+	exit(EXIT_FAILURE);
+}
+
+/* write_attr: Write a sysfs attribute that is only touched now and then */
+static int write_attr(const char *path, const char *buf)
+{
+	int fd, err;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		return -1;
 	}
+	if (write(fd, buf, strlen(buf)) == -1) {
+		err = errno;
+		close(fd);
+		errno = err;
 
-	dht11_humi_fd = open(DHT11_HUMI_FILE_PATH, O_RDONLY);
-	if (dht11_humi_fd == -1) {
-		fprintf(stderr, "Fail to open file: %s\n", DHT11_HUMI_FILE_PATH);
+		return -1;
+	}
+	close(fd);
 
-		close(dht11_temp_fd);
+	return 0;
+}
 
-		exit(EXIT_FAILURE);
+static long long monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* stage_record: Only in benchmark mode, and only the first BENCH_MAX_SAMPLES */
+static void stage_record(struct stage *stage, long long ns)
+{
+	if (!stage->samples) {
+		if (!bench_steps) {
+			return;
+		}
+		stage->samples = malloc(BENCH_MAX_SAMPLES * sizeof(*stage->samples));
+		if (!stage->samples) {
+			return;
+		}
 	}
 
-	RYGleds_fd = open(RYGLEDS_FILE_PATH, O_WRONLY);
-	if (RYGleds_fd == -1) {
-		fprintf(stderr, "Fail to open file: %s\n", RYGLEDS_FILE_PATH);
+	if (stage->count < BENCH_MAX_SAMPLES) {
+		stage->samples[stage->count++] = ns;
+	}
+}
 
-		close(dht11_humi_fd);
-		close(dht11_temp_fd);
+static enum band temperature_band(int temperature)
+{
+	if (temperature <= BAND_GREEN_MAX) {
+		return BAND_GREEN;
+	} else if (temperature <= BAND_YELLOW_MAX) {
+		return BAND_YELLOW;
+	}
 
-		exit(EXIT_FAILURE);
+	return BAND_RED;
+}
+
+/* sink_open: Open the sink's files that aren't, and register them with its ring.
+ * Returns the number of files.
+ */
+static int sink_open(struct sink *sink)
+{
+	int n, opened = 0;
+
+	for (n = 0; n < 2 && sink->paths[n]; ++n) {
+		if (sink->fds[n] == -1) {
+			sink->fds[n] = open(*sink->paths[n], O_WRONLY);
+			if (sink->fds[n] == -1) {
+				return -1;
+			}
+			opened = 1;
+		}
+	}
+
+	if (opened) {
+		io_ring_files(&sink->ring, sink->fds, n);
 	}
 
-	buzzer_fd = open(BUZZER_FILE_PATH, O_WRONLY);
-	if (buzzer_fd == -1) {
-		fprintf(stderr, "Fail to open file: %s\n", BUZZER_FILE_PATH);
+	return n;
+}
 
-		close(RYGleds_fd);
-		close(dht11_humi_fd);
-		close(dht11_temp_fd);
+/* sink_write_values: values[n] goes to the sink's n-th file, all in one batch.
+ * The writes are linked, a failed one cancels those after it.
+ */
+static int sink_write_values(struct sink *sink, const int *values)
+{
+	char bufs[2][16];
+	struct io_req reqs[2];
+	int n, num;
 
-		exit(EXIT_FAILURE);
+	num = sink_open(sink);
+	if (num == -1) {
+		return -1;
 	}
 
-	lcd1602_temp_fd = open(LCD1602_TEMP_FILE_PATH, O_WRONLY);
-	if (lcd1602_temp_fd == -1) {
-		fprintf(stderr, "Fail to open file: %s\n", LCD1602_TEMP_FILE_PATH);
+	for (n = 0; n < num; ++n) {
+		io_req_set(&reqs[n], sink->fds[n], 1, 0, bufs[n], snprintf(bufs[n], sizeof(bufs[n]), "%d", values[n]));
+	}
 
-		close(buzzer_fd);
-		close(RYGleds_fd);
-		close(dht11_humi_fd);
-		close(dht11_temp_fd);
+	if (io_batch(&sink->ring, reqs, num, 1)) {
+		return -1;
+	}
 
-		exit(EXIT_FAILURE);
+	for (n = 0; n < num; ++n) {
+		if (reqs[n].res < 0) {
+			errno = -reqs[n].res;
+
+			return -1;
+		}
 	}
 
-	lcd1602_humi_fd = open(LCD1602_HUMI_FILE_PATH, O_WRONLY);
-	if (lcd1602_humi_fd == -1) {
-		fprintf(stderr, "Fail to open file: %s\n", LCD1602_HUMI_FILE_PATH);
+	return 0;
+}
 
-		close(lcd1602_temp_fd);
-		close(buzzer_fd);
-		close(RYGleds_fd);
-		close(dht11_humi_fd);
-		close(dht11_temp_fd);
+/* RYGleds_changed: Every bank has its own thresholds in DT, so any temperature
+ * change can move one of them to another LED
+ */
+static int RYGleds_changed(const struct sink *sink, const struct reading *reading)
+{
+	return reading->temperature != sink->last.temperature;
+}
 
-		exit(EXIT_FAILURE);
+/* buzzer_changed: buzzer_tone() only sounds above BAND_YELLOW_MAX */
+static int buzzer_changed(const struct sink *sink, const struct reading *reading)
+{
+	return (reading->temperature > BAND_YELLOW_MAX) != (sink->last.temperature > BAND_YELLOW_MAX);
+}
+
+static int lcd1602_changed(const struct sink *sink, const struct reading *reading)
+{
+	return abs(reading->temperature - sink->last.temperature) > LCD1602_TEMP_DEADBAND
+		|| abs(reading->humidity - sink->last.humidity) > LCD1602_HUMI_DEADBAND;
+}
+
+static int write_temperature(struct sink *sink, const struct reading *reading)
+{
+	int values[1] = { reading->temperature };
+
+	return sink_write_values(sink, values);
+}
+
+/* write_lcd1602: Every redraw costs ~80ms of the LCD driver's work. It only
+ * redraws on a humidity write, so temperature goes first and a failed
+ * temperature write cancels the redraw.
+ */
+static int write_lcd1602(struct sink *sink, const struct reading *reading)
+{
+	int values[2] = { reading->temperature, reading->humidity };
+
+	return sink_write_values(sink, values);
+}
+
+static struct sink sinks[] = {
+	{
+		.name = "RYGleds",
+		.paths = { &config.rygleds },
+		.changed = RYGleds_changed,
+		.write = write_temperature,
+		.min_interval = RYGLEDS_MIN_INTERVAL,
+	}, {
+		.name = "buzzer",
+		.paths = { &config.buzzer },
+		.changed = buzzer_changed,
+		.write = write_temperature,
+		.min_interval = BUZZER_MIN_INTERVAL,
+	}, {
+		.name = "lcd1602",
+		.paths = { &config.lcd1602_temperature, &config.lcd1602_humidity },
+		.changed = lcd1602_changed,
+		.write = write_lcd1602,
+		.min_interval = LCD1602_MIN_INTERVAL,
+	},
+};
+
+#define NUM_SINKS (sizeof(sinks) / sizeof(sinks[0]))
+
+/* sink_wait_interval: Sleep until min_interval after the last write */
+static void sink_wait_interval(struct sink *sink)
+{
+	struct timespec until = sink->last_write;
+
+	if (!sink->min_interval || !sink->writes) {
+		return;
+	}
+
+	until.tv_sec += sink->min_interval / 1000;
+	until.tv_nsec += (sink->min_interval % 1000) * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec += 1;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+	}
+}
+
+static void sink_close(struct sink *sink)
+{
+	int n;
+
+	io_ring_files(&sink->ring, NULL, 0);
+
+	for (n = 0; n < 2; ++n) {
+		if (sink->fds[n] != -1) {
+			close(sink->fds[n]);
+			sink->fds[n] = -1;
+		}
+	}
+}
+
+static void *sink_worker(void *arg)
+{
+	struct sink *sink = arg;
+	struct reading reading;
+	long long posted;
+
+	if (use_uring) {
+		io_ring_init(&sink->ring);
 	}
 
 	while (1) {
-		sleep(5);
+		pthread_mutex_lock(&sink->lock);
+		while (!sink->has_pending && !sink->stop) {
+			pthread_cond_wait(&sink->cond, &sink->lock);
+		}
+		if (sink->stop) {
+			pthread_mutex_unlock(&sink->lock);
 
-		num_read = read(dht11_temp_fd, temp_buf, BUF_SIZE);
-		if (num_read == -1) {
-			fprintf(stderr, "Fail to read file: %s\n", DHT11_TEMP_FILE_PATH);
+			break;
+		}
+		reading = sink->pending;
+		posted = sink->posted;
+		sink->has_pending = 0;
+		pthread_mutex_unlock(&sink->lock);
+
+		if (sink->valid && !sink->changed(sink, &reading)) {
+			continue;
+		}
 
-			close(lcd1602_humi_fd);
-			close(lcd1602_temp_fd);
-			close(buzzer_fd);
-			close(RYGleds_fd);
-			close(dht11_humi_fd);
-			close(dht11_temp_fd);
+		sink_wait_interval(sink);
 
-			exit(EXIT_FAILURE);
+		/* Readings posted while waiting win */
+		pthread_mutex_lock(&sink->lock);
+		if (sink->has_pending) {
+			reading = sink->pending;
+			posted = sink->posted;
+			sink->has_pending = 0;
 		}
-		temp_buf[num_read - 1] = '\0';
-		lseek(dht11_temp_fd, -num_read, SEEK_CUR);
+		pthread_mutex_unlock(&sink->lock);
 
-		num_read = read(dht11_humi_fd, humi_buf, BUF_SIZE);
-		if (num_read == -1) {
-			fprintf(stderr, "Fail to read file: %s\n", DHT11_HUMI_FILE_PATH);
+		clock_gettime(CLOCK_MONOTONIC, &sink->last_write);
+		++sink->writes;
 
-			close(lcd1602_humi_fd);
-			close(lcd1602_temp_fd);
-			close(buzzer_fd);
-			close(RYGleds_fd);
-			close(dht11_humi_fd);
-			close(dht11_temp_fd);
+		if (sink->write(sink, &reading)) {
+			++sink->errors;
+			fprintf(stderr, "Fail to write %s (%s), %lu of %lu writes failed\n", sink->name, strerror(errno), sink->errors, sink->writes);
 
-			exit(EXIT_FAILURE);
+			/* Start over with fresh fds and write the next reading whatever it is */
+			sink_close(sink);
+			sink->valid = 0;
+
+			continue;
 		}
-		humi_buf[num_read - 1] = '\0';
-		lseek(dht11_humi_fd, -num_read, SEEK_CUR);
 
-		num_write = write(RYGleds_fd, temp_buf, (size_t)strlen(temp_buf));
-		if (num_write == -1) {
-			fprintf(stderr, "Fail to write file: %s\n", RYGLEDS_FILE_PATH);
+		stage_record(&sink->stage, monotonic_ns() - posted);
+
+		sink->last = reading;
+		sink->valid = 1;
+	}
+
+	sink_close(sink);
+	io_ring_exit(&sink->ring);
+
+	return NULL;
+}
 
-			close(lcd1602_humi_fd);
-			close(lcd1602_temp_fd);
-			close(buzzer_fd);
-			close(RYGleds_fd);
-			close(dht11_humi_fd);
-			close(dht11_temp_fd);
+/* sink_post: Hand a reading to the sink's worker, never blocks on the sink */
+static void sink_post(struct sink *sink, const struct reading *reading)
+{
+	pthread_mutex_lock(&sink->lock);
+	sink->pending = *reading;
+	sink->posted = monotonic_ns();
+	sink->has_pending = 1;
+	pthread_cond_signal(&sink->cond);
+	pthread_mutex_unlock(&sink->lock);
+}
 
-			exit(EXIT_FAILURE);
+static void sinks_start(void)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SINKS; ++i) {
+		sinks[i].fds[0] = -1;
+		sinks[i].fds[1] = -1;
+		sinks[i].ring.fd = -1;
+		sinks[i].stage.name = sinks[i].name;
+		pthread_mutex_init(&sinks[i].lock, NULL);
+		pthread_cond_init(&sinks[i].cond, NULL);
+
+		if (pthread_create(&sinks[i].thread, NULL, sink_worker, &sinks[i])) {
+			fail("start worker", sinks[i].name);
 		}
+	}
+}
 
-		num_write = write(buzzer_fd, temp_buf, (size_t)strlen(temp_buf));
-		if (num_write == -1) {
-			fprintf(stderr, "Fail to write file: %s\n", BUZZER_FILE_PATH);
+/* sinks_stop: Let every worker finish its current write and join it */
+static void sinks_stop(void)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SINKS; ++i) {
+		pthread_mutex_lock(&sinks[i].lock);
+		sinks[i].stop = 1;
+		pthread_cond_signal(&sinks[i].cond);
+		pthread_mutex_unlock(&sinks[i].lock);
+	}
 
-			close(lcd1602_humi_fd);
-			close(lcd1602_temp_fd);
-			close(buzzer_fd);
-			close(RYGleds_fd);
-			close(dht11_humi_fd);
-			close(dht11_temp_fd);
+	for (i = 0; i < NUM_SINKS; ++i) {
+		pthread_join(sinks[i].thread, NULL);
+	}
+}
 
-			exit(EXIT_FAILURE);
+static void post_all(const struct reading *reading)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SINKS; ++i) {
+		sink_post(&sinks[i], reading);
+	}
+}
+
+static void epoll_add(int fd, const char *what)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		fail("watch", what);
+	}
+}
+
+/* main_files: Register what the main thread reads with its ring */
+static void main_files(void)
+{
+	int fds[3], num = 0;
+
+	if (dht11_sample_fd != -1) {
+		fds[num++] = dht11_sample_fd;
+	}
+	if (dht11_event_fd != -1) {
+		fds[num++] = dht11_event_fd;
+	}
+	fds[num++] = timer_fd;
+
+	io_ring_files(&main_ring, fds, num);
+}
+
+/* sensor_close: Let go of a device that went away. The ring and epoll hold
+ * references of their own, so both drop theirs first.
+ */
+static void sensor_close(void)
+{
+	io_ring_files(&main_ring, NULL, 0);
+
+	if (dht11_sample_fd != -1) {
+		close(dht11_sample_fd);
+		dht11_sample_fd = -1;
+	}
+
+	/* The fake sensor's pipe never goes away */
+	if (!fake_mode && dht11_event_fd != -1) {
+		if (event_watched) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dht11_event_fd, NULL);
+			event_watched = 0;
 		}
+		close(dht11_event_fd);
+		dht11_event_fd = -1;
+	}
 
-		num_write = write(lcd1602_temp_fd, temp_buf, (size_t)strlen(temp_buf));
-		if (num_write == -1) {
-			fprintf(stderr, "Fail to write file: %s\n", LCD1602_TEMP_FILE_PATH);
+	main_files();
+}
 
-			close(lcd1602_humi_fd);
-			close(lcd1602_temp_fd);
-			close(buzzer_fd);
-			close(RYGleds_fd);
-			close(dht11_humi_fd);
-			close(dht11_temp_fd);
+/* sensor_gone: The module was unloaded or the device removed, the fds are dead */
+static int sensor_gone(int err)
+{
+	return err == ENODEV || err == ENOENT || err == ENXIO || err == ESTALE;
+}
+
+/* sensor_error: Nothing the sensor does makes us exit. Any error retries after
+ * a validity window, doubling up to DHT11_MAX_BACKOFF while it keeps failing;
+ * when the device is gone its fds are closed and the retry opens them again.
+ * Errors while a retry is pending are only counted. Meanwhile the sinks keep
+ * the last good reading, a sink that lost its own write gets it again.
+ */
+static void sensor_error(const char *what, int err)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	int gone = sensor_gone(err);
 
-			exit(EXIT_FAILURE);
+	++sensor_errors;
+
+	if (gone) {
+		sensor_close();
+	}
+
+	if (retry_armed) {
+		return;
+	}
+
+	sensor_backoff = sensor_backoff ? sensor_backoff * 2 : DHT11_VALIDITY_WINDOW;
+	if (sensor_backoff > DHT11_MAX_BACKOFF) {
+		sensor_backoff = DHT11_MAX_BACKOFF;
+	}
+
+	its.it_value.tv_sec = sensor_backoff;
+	if (timerfd_settime(retry_fd, 0, &its, NULL) == -1) {
+		fail("arm", "retry timerfd");
+	}
+	retry_armed = 1;
+
+	fprintf(stderr, "Fail to %s (%s), %s in %ds, %lu errors\n", what, strerror(err),
+		dht11_sample_fd == -1 ? "reopening" : "retrying", sensor_backoff, sensor_errors);
+
+	if (have_good) {
+		post_all(&last_good);
+	}
+}
+
+static void sensor_ok(const struct reading *reading)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	last_good = *reading;
+	have_good = 1;
+
+	if (!sensor_backoff) {
+		return;
+	}
+
+	fprintf(stderr, "Sensor back after %lu errors\n", sensor_errors);
+	sensor_backoff = 0;
+
+	if (retry_armed) {
+		timerfd_settime(retry_fd, 0, &its, NULL);
+		retry_armed = 0;
+	}
+}
+
+/* sensor_open: Open in_sample and the event fd, and start the driver sampling */
+static int sensor_open(void)
+{
+	int dev_fd, ret, err;
+
+	dht11_sample_fd = open(config.sample, O_RDONLY);
+	if (dht11_sample_fd == -1) {
+		sensor_error("open sample", errno);
+
+		return -1;
+	}
+
+	/* Events are only checked on frames the driver decodes */
+	if (write_attr(config.sampling_frequency, DHT11_SAMPLING_FREQUENCY)) {
+		err = errno;
+		sensor_close();
+		sensor_error("start sampling", err);
+
+		return -1;
+	}
+
+	/* The event fd comes from the IIO character device */
+	if (!fake_mode) {
+		dev_fd = open(config.device, O_RDONLY);
+		ret = dev_fd == -1 ? -1 : ioctl(dev_fd, IIO_GET_EVENT_FD_IOCTL, &dht11_event_fd);
+		err = errno;
+		if (dev_fd != -1) {
+			close(dev_fd);
+		}
+		if (ret == -1) {
+			dht11_event_fd = -1;
+			sensor_close();
+			sensor_error("get event fd", err);
+
+			return -1;
+		}
+	}
+
+	if (!event_watched) {
+		epoll_add(dht11_event_fd, config.device);
+		event_watched = 1;
+	}
+
+	main_files();
+
+	return 0;
+}
+
+/* read_sample: Temperature and humidity come from the same frame. The fd that
+ * woke the loop up (wake_fd, -1 for none) is drained in the same batch.
+ * Returns the number of bytes read from wake_fd, or -1.
+ */
+static int read_sample(struct reading *reading, int wake_fd, void *wake_buf, size_t wake_len)
+{
+	char sample_buf[BUF_SIZE];
+	struct io_req reqs[2];
+	long long timestamp, start;
+	int num = 0;
+
+	if (wake_fd != -1) {
+		io_req_set(&reqs[num++], wake_fd, 0, 1, wake_buf, wake_len);
+	}
+	if (dht11_sample_fd != -1) {
+		io_req_set(&reqs[num++], dht11_sample_fd, 0, 0, sample_buf, BUF_SIZE - 1);
+	}
+	if (!num) {
+		return -1;
+	}
+
+	start = monotonic_ns();
+	if (io_batch(&main_ring, reqs, num, 0)) {
+		fail("submit", "io_uring");
+	}
+	stage_record(&stage_read, monotonic_ns() - start);
+	++sample_reads;
+
+	if (wake_fd == timer_fd && reqs[0].res < 0) {
+		fail("read", "timerfd");
+	}
+	/* The event fd reads 0 or fails once the device is gone */
+	if (wake_fd == dht11_event_fd && reqs[0].res <= 0) {
+		sensor_error("read events", reqs[0].res ? -reqs[0].res : ENODEV);
+
+		return -1;
+	}
+
+	if (dht11_sample_fd == -1) {
+		return -1; /* Reopened by the retry */
+	}
+	/* -EIO on a checksum error, -ETIMEDOUT without a frame, nothing at all
+	 * shouldn't happen but mustn't be parsed either
+	 */
+	if (reqs[num - 1].res <= 0) {
+		sensor_error("read sample", reqs[num - 1].res ? -reqs[num - 1].res : ENODATA);
+
+		return -1;
+	}
+	sample_buf[reqs[num - 1].res] = '\0';
+
+	if (sscanf(sample_buf, "%d %d %lld", &reading->temperature, &reading->humidity, &timestamp) != 3) {
+		fprintf(stderr, "Fail to parse sample: %s\n", sample_buf);
+		sensor_error("parse sample", EINVAL);
+
+		return -1;
+	}
+
+	sensor_ok(reading);
+
+	return wake_fd != -1 ? reqs[0].res : 0;
+}
+
+static int write_event(const char *name, int value)
+{
+	char path[BUF_SIZE], buf[BUF_SIZE];
+
+	snprintf(path, BUF_SIZE, "%s/%s", config.events, name);
+	snprintf(buf, BUF_SIZE, "%d", value);
+
+	return write_attr(path, buf);
+}
+
+/* set_window: Arm only the thresholds that leave the current band */
+static int set_window(enum band band)
+{
+	if (band != BAND_RED) {
+		if (write_event("in_temp_thresh_rising_value", band == BAND_GREEN ? BAND_GREEN_MAX + 1 : BAND_YELLOW_MAX + 1)) {
+			return -1;
+		}
+	}
+	if (band != BAND_GREEN) {
+		if (write_event("in_temp_thresh_falling_value", band == BAND_YELLOW ? BAND_GREEN_MAX : BAND_YELLOW_MAX)) {
+			return -1;
+		}
+	}
+
+	if (write_event("in_temp_thresh_rising_en", band != BAND_RED)) {
+		return -1;
+	}
+
+	return write_event("in_temp_thresh_falling_en", band != BAND_GREEN);
+}
+
+/* update_band: Post the current reading to the sinks and move the window with it.
+ * The temperature can change while the window moves, so check it again after.
+ * With events set, the pending threshold events are read with the first sample.
+ */
+static void update_band(int events)
+{
+	struct iio_event_data event_buf[16];
+	struct reading reading;
+	enum band band;
+	long long start;
+	int ret, n;
+
+	start = monotonic_ns();
+	ret = read_sample(&reading, events ? dht11_event_fd : -1, event_buf, sizeof(event_buf));
+	if (ret == -1) {
+		return;
+	}
+
+	/* Only the fake sensor stamps events with CLOCK_MONOTONIC */
+	if (fake_mode) {
+		for (n = 0; n < ret / (int)sizeof(event_buf[0]); ++n) {
+			stage_record(&stage_event, start - event_buf[n].timestamp);
+		}
+	}
+
+	do {
+		band = temperature_band(reading.temperature);
+
+		post_all(&reading);
+
+		if (set_window(band)) {
+			sensor_error("arm thresholds", errno);
+
+			return;
+		}
+
+		if (read_sample(&reading, -1, NULL, 0) == -1) {
+			return;
+		}
+	} while (temperature_band(reading.temperature) != band);
+
+	stage_record(&stage_update, monotonic_ns() - start);
+}
+
+/* setup_loop: One epoll set for threshold events, the LCD refresh timer, sensor
+ * retries and SIGINT/SIGTERM. sensor_open() adds the event fd.
+ */
+static void setup_loop(void)
+{
+	struct itimerspec its = { { LCD1602_REFRESH_INTERVAL, 0 }, { LCD1602_REFRESH_INTERVAL, 0 } };
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		fail("create", "epoll");
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd == -1 || timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
+		fail("create", "timerfd");
+	}
+
+	/* Non-blocking, sensor_ok() may disarm it after epoll saw it expire */
+	retry_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (retry_fd == -1) {
+		fail("create", "retry timerfd");
+	}
+
+	signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		fail("create", "signalfd");
+	}
+
+	epoll_add(timer_fd, "timerfd");
+	epoll_add(retry_fd, "retry timerfd");
+	epoll_add(signal_fd, "signalfd");
+}
+
+/* setup_io: Use io_uring if asked for and there, the plain syscalls otherwise */
+static void setup_io(void)
+{
+	if (use_uring && io_ring_init(&main_ring)) {
+		fprintf(stderr, "io_uring not available (%s), using plain syscalls\n", strerror(errno));
+		use_uring = 0;
+	}
+}
+
+/* block_signals: Signals are only taken from signal_fd, so shutdown runs in the
+ * loop. Blocked before any thread starts, they all inherit the mask.
+ */
+static void block_signals(void)
+{
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &signal_mask, NULL) == -1) {
+		fail("block", "signals");
+	}
+}
+
+/* config_iio: The device node and sysfs attributes of an IIO device name */
+static void config_iio(const char *name)
+{
+	char path[BUF_SIZE];
+
+	snprintf(path, BUF_SIZE, "%s/%s", IIO_DEV_DIR_PATH, name);
+	config.device = strdup(path);
+	snprintf(path, BUF_SIZE, "%s/%s/in_sample", IIO_SYSFS_DIR_PATH, name);
+	config.sample = strdup(path);
+	snprintf(path, BUF_SIZE, "%s/%s/sampling_frequency", IIO_SYSFS_DIR_PATH, name);
+	config.sampling_frequency = strdup(path);
+	snprintf(path, BUF_SIZE, "%s/%s/events", IIO_SYSFS_DIR_PATH, name);
+	config.events = strdup(path);
+}
+
+static void config_set(const char *key, const char *value, const char *from)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); ++i) {
+		if (!strcmp(key, config_keys[i].key)) {
+			*config_keys[i].value = strdup(value);
+
+			return;
+		}
+	}
+
+	fprintf(stderr, "Unknown key %s in %s\n", key, from);
+
+	exit(EXIT_FAILURE);
+}
+
+/* config_load: "key = value" or "key value" lines, # starts a comment */
+static void config_load(const char *path)
+{
+	char line[BUF_SIZE], key[64], value[BUF_SIZE];
+	FILE *file;
+	char *hash;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fail("open file", path);
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		hash = strchr(line, '#');
+		if (hash) {
+			*hash = '\0';
 		}
 
-		num_write = write(lcd1602_humi_fd, humi_buf, (size_t)strlen(humi_buf));
-		if (num_write == -1) {
-			fprintf(stderr, "Fail to write file: %s\n", LCD1602_HUMI_FILE_PATH);
+		if (sscanf(line, " %63[^= \t\n] = %1023s", key, value) == 2) {
+			config_set(key, value, path);
+		}
+	}
+	fclose(file);
+}
+
+/* config_option: -o key=value */
+static void config_option(char *option)
+{
+	char *value = strchr(option, '=');
+
+	if (!value) {
+		fprintf(stderr, "Expected key=value: %s\n", option);
+
+		exit(EXIT_FAILURE);
+	}
+	*value++ = '\0';
+
+	config_set(option, value, "-o");
+}
+
+/* setup_fake: Point every path into a fresh fake tree and start its sensor */
+static void setup_fake(const char *dir, const char *script, unsigned long period)
+{
+	if (fake_script(&fake, script)) {
+		fail("read script", script);
+	}
+	if (fake_create(&fake, dir)) {
+		fail("create fake tree in", dir);
+	}
+
+	config.device = fake.root;
+	config.sample = fake.sample;
+	config.sampling_frequency = fake.sampling_frequency;
+	config.events = fake.events;
+	config.rygleds = fake.rygleds;
+	config.buzzer = fake.buzzer;
+	config.lcd1602_temperature = fake.lcd1602_temperature;
+	config.lcd1602_humidity = fake.lcd1602_humidity;
+
+	fake.period = period * 1000L;
+	fake.max_steps = bench_steps;
+
+	dht11_event_fd = fake_start(&fake);
+	if (dht11_event_fd == -1) {
+		fail("start fake sensor in", fake.root);
+	}
+
+	fprintf(stderr, "Fake tree in %s\n", fake.root);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void stage_report(struct stage *stage)
+{
+	long long sum = 0;
+	unsigned long i;
+
+	if (!stage->count) {
+		printf("%-10s %8d\n", stage->name, 0);
+
+		return;
+	}
+
+	qsort(stage->samples, stage->count, sizeof(*stage->samples), compare_ns);
+	for (i = 0; i < stage->count; ++i) {
+		sum += stage->samples[i];
+	}
+
+	printf("%-10s %8lu %10.1f %10.1f %10.1f %10.1f\n", stage->name, stage->count,
+		sum / 1000.0 / stage->count,
+		stage->samples[stage->count / 2] / 1000.0,
+		stage->samples[stage->count * 99 / 100] / 1000.0,
+		stage->samples[stage->count - 1] / 1000.0);
+
+	free(stage->samples);
+	stage->samples = NULL;
+}
+
+/* bench_report: Throughput of the loop, then per stage: event is fake sensor to
+ * loop, read one read_sample() batch, update one update_band() and the sinks
+ * post to written.
+ */
+static void bench_report(long long elapsed)
+{
+	double seconds = elapsed / 1e9;
+	size_t i;
+
+	printf("%s, %.2fs\n", use_uring ? "io_uring" : "plain syscalls", seconds);
+	printf("steps %lu (%.0f/s), events %lu sent %lu handled (%.0f/s), sample reads %lu (%.0f/s)\n",
+		fake.emitted, fake.emitted / seconds, fake.sent, event_wakeups, event_wakeups / seconds,
+		sample_reads, sample_reads / seconds);
+	printf("%-10s %8s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+
+	stage_report(&stage_event);
+	stage_report(&stage_read);
+	stage_report(&stage_update);
+	for (i = 0; i < NUM_SINKS; ++i) {
+		stage_report(&sinks[i].stage);
+	}
+	for (i = 0; i < NUM_SINKS; ++i) {
+		printf("%s: %lu writes, %lu errors\n", sinks[i].name, sinks[i].writes, sinks[i].errors);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-d iio:deviceN] [-c file] [-o key=value] [-u | -p]\n"
+		"       %s -F [-r dir] [-s script] [-t us] [-b steps]\n"
+		"  -d  IIO device of the DHT11 (default " DHT11_IIO_DEVICE ")\n"
+		"  -c  Config file of key = value lines\n"
+		"  -o  Set one key, keys are device, sample, sampling_frequency, events,\n"
+		"      rygleds, buzzer, lcd1602_temperature and lcd1602_humidity\n"
+		"  -u  Batch the reads and writes through io_uring\n"
+		"  -p  Plain syscalls (default)\n"
+		"  -F  Fake sensor and sinks in a tmpfs directory under -r (default " FAKE_DIR_PATH "),\n"
+		"      replacing every path\n"
+		"  -s  Sensor script of temperature humidity lines, stepped every -t us\n"
+		"  -b  Benchmark: fake mode, exit after as many steps and report\n"
+		"Options apply in order, later ones override earlier ones.\n",
+		name, name);
+
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *fake_dir = FAKE_DIR_PATH, *script = NULL;
+	unsigned long period = 0;
+	struct epoll_event ready[3];
+	struct signalfd_siginfo si;
+	struct reading reading;
+	uint64_t expirations;
+	long long bench_start;
+	int opt, ret, i;
+
+	config_iio(DHT11_IIO_DEVICE);
+
+	while ((opt = getopt(argc, argv, "d:c:o:upFr:s:t:b:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			config_iio(optarg);
+			break;
+		case 'c':
+			config_load(optarg);
+			break;
+		case 'o':
+			config_option(optarg);
+			break;
+		case 'u':
+			use_uring = 1;
+			break;
+		case 'p':
+			use_uring = 0;
+			break;
+		case 'F':
+			fake_mode = 1;
+			break;
+		case 'r':
+			fake_dir = optarg;
+			break;
+		case 's':
+			script = optarg;
+			break;
+		case 't':
+			period = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			fake_mode = 1;
+			bench_steps = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+	}
+
+	block_signals();
+
+	if (fake_mode) {
+		if (!period) {
+			period = bench_steps ? BENCH_PERIOD : FAKE_PERIOD;
+		}
+		setup_fake(fake_dir, script, period);
+	}
+
+	setup_loop();
+	setup_io();
+	sinks_start();
+
+	/* Without the sensor yet, it's retried like after any error */
+	bench_start = monotonic_ns();
+	if (!sensor_open()) {
+		update_band(0);
+	}
+
+	while (1) {
+		ret = epoll_wait(epoll_fd, ready, sizeof(ready) / sizeof(ready[0]), -1);
+		if (ret == -1) {
+			fail("wait", "epoll");
+		}
+
+		for (i = 0; i < ret; ++i) {
+			if (ready[i].data.fd == signal_fd) {
+				if (read(signal_fd, &si, sizeof(si)) == sizeof(si) && !bench_steps) {
+					fprintf(stderr, "Exiting on signal %u\n", si.ssi_signo);
+				}
+
+				sinks_stop();
+				if (fake_mode) {
+					fake_stop(&fake);
+				}
+				if (bench_steps) {
+					bench_report(monotonic_ns() - bench_start);
+				}
+				io_ring_exit(&main_ring);
+				close_all();
 
-			close(lcd1602_humi_fd);
-			close(lcd1602_temp_fd);
-			close(buzzer_fd);
-			close(RYGleds_fd);
-			close(dht11_humi_fd);
-			close(dht11_temp_fd);
+				return EXIT_SUCCESS;
+			} else if (ready[i].data.fd == timer_fd) {
+				/* Readings inside the band only change the LCD, the others drop them */
+				if (read_sample(&reading, timer_fd, &expirations, sizeof(expirations)) != -1) {
+					post_all(&reading);
+				}
+			} else if (ready[i].data.fd == retry_fd) {
+				if (read(retry_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+					fail("read", "retry timerfd");
+				}
 
-			exit(EXIT_FAILURE);
+				retry_armed = 0;
+				if (dht11_sample_fd != -1 || !sensor_open()) {
+					update_band(0);
+				}
+			} else if (ready[i].data.fd == dht11_event_fd) {
+				/* Which threshold fired doesn't matter, the new band is read back */
+				++event_wakeups;
+				update_band(1);
+			}
 		}
 	}
 
@@ -0,0 +1,334 @@
+/*
+ * Fake DHT11 and sink files for app.c
+ *
+ * fake_create() lays out the files app.c uses in a fresh directory under a
+ * tmpfs (/dev/shm by default): in_sample, sampling_frequency, the threshold
+ * event attributes and the sink attributes. A sensor thread then steps
+ * through a script of temperature/humidity pairs, rewrites in_sample on every
+ * step and, like dht11_events() in rpi_dht11_driver.c, writes a struct
+ * iio_event_data to a pipe standing in for the IIO event fd when the
+ * temperature crosses an enabled threshold. app.c runs on any Linux host
+ * this way, without the board.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef APP_FAKE_H
+#define APP_FAKE_H
+
+#include <stdio.h> /* snprintf(), fopen(), fgets() */
+#include <stdlib.h> /* mkdtemp(), atoi() */
+#include <string.h> /* strcpy() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* pread(), pwrite(), pipe(), unlink(), rmdir() */
+#include <signal.h> /* kill() */
+#include <time.h> /* clock_gettime(), clock_nanosleep() */
+#include <pthread.h> /* pthread_create(), pthread_join() */
+#include <sys/stat.h> /* mkdir() */
+#include <linux/iio/events.h> /* struct iio_event_data */
+
+#define FAKE_PATH_SIZE 256
+#define FAKE_MAX_PATHS 16
+#define FAKE_MAX_STEPS 1024
+
+/* The default script crosses a band on every step */
+static const int fake_default_script[][2] = {
+	{ 20, 40 }, { 28, 45 }, { 33, 50 }, { 28, 45 },
+};
+
+struct fake {
+	char root[FAKE_PATH_SIZE];
+	char sample[FAKE_PATH_SIZE];
+	char sampling_frequency[FAKE_PATH_SIZE];
+	char events[FAKE_PATH_SIZE];
+	char rygleds[FAKE_PATH_SIZE];
+	char buzzer[FAKE_PATH_SIZE];
+	char lcd1602_temperature[FAKE_PATH_SIZE];
+	char lcd1602_humidity[FAKE_PATH_SIZE];
+
+	/* Created paths, removed in reverse by fake_destroy() */
+	char created[FAKE_MAX_PATHS][FAKE_PATH_SIZE];
+	int num_created;
+
+	int steps[FAKE_MAX_STEPS][2]; /* temperature, humidity */
+	int num_steps;
+	long period; /* ns between steps */
+	unsigned long max_steps; /* SIGTERM to the process after as many, 0 for none */
+
+	int event_pipe[2]; /* [0] is app.c's event fd */
+	int sample_fd;
+	int prev; /* Temperature of the last step */
+	pthread_t thread;
+	volatile int stop;
+	unsigned long emitted, sent; /* Only read after fake_stop() */
+};
+
+/* fake_file: Create root/name with an initial value and remember it */
+static inline int fake_file(struct fake *fake, char *path, const char *name, const char *value)
+{
+	int fd;
+
+	if (snprintf(path, FAKE_PATH_SIZE, "%s/%s", fake->root, name) >= FAKE_PATH_SIZE) {
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return -1;
+	}
+	if (write(fd, value, strlen(value)) == -1) {
+		close(fd);
+
+		return -1;
+	}
+	close(fd);
+
+	strcpy(fake->created[fake->num_created++], path);
+
+	return 0;
+}
+
+static inline int fake_dir(struct fake *fake, char *path, const char *name)
+{
+	if (snprintf(path, FAKE_PATH_SIZE, "%s/%s", fake->root, name) >= FAKE_PATH_SIZE) {
+		return -1;
+	}
+
+	if (mkdir(path, 0755) == -1) {
+		return -1;
+	}
+	strcpy(fake->created[fake->num_created++], path);
+
+	return 0;
+}
+
+/* fake_script: Read "temperature humidity" lines, # starts a comment. Without
+ * a path the default script is used.
+ */
+static inline int fake_script(struct fake *fake, const char *path)
+{
+	char line[128];
+	FILE *file;
+	size_t i;
+
+	fake->num_steps = 0;
+
+	if (!path) {
+		for (i = 0; i < sizeof(fake_default_script) / sizeof(fake_default_script[0]); ++i) {
+			fake->steps[i][0] = fake_default_script[i][0];
+			fake->steps[i][1] = fake_default_script[i][1];
+		}
+		fake->num_steps = i;
+
+		return 0;
+	}
+
+	file = fopen(path, "r");
+	if (!file) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) && fake->num_steps < FAKE_MAX_STEPS) {
+		if (sscanf(line, "%d %d", &fake->steps[fake->num_steps][0], &fake->steps[fake->num_steps][1]) == 2) {
+			++fake->num_steps;
+		}
+	}
+	fclose(file);
+
+	if (!fake->num_steps) {
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/* fake_create: Lay out the tree in a new directory under base */
+static inline int fake_create(struct fake *fake, const char *base)
+{
+	char path[FAKE_PATH_SIZE];
+
+	if (snprintf(fake->root, FAKE_PATH_SIZE, "%s/app-fake-XXXXXX", base) >= FAKE_PATH_SIZE || !mkdtemp(fake->root)) {
+		return -1;
+	}
+	strcpy(fake->created[fake->num_created++], fake->root);
+
+	if (fake_dir(fake, path, "iio") || fake_dir(fake, fake->events, "iio/events")
+		|| fake_dir(fake, path, "RYGleds") || fake_dir(fake, path, "buzzer") || fake_dir(fake, path, "lcd1602")) {
+		return -1;
+	}
+
+	if (fake_file(fake, fake->sample, "iio/in_sample", "")
+		|| fake_file(fake, fake->sampling_frequency, "iio/sampling_frequency", "0\n")
+		|| fake_file(fake, path, "iio/events/in_temp_thresh_rising_value", "30\n")
+		|| fake_file(fake, path, "iio/events/in_temp_thresh_rising_en", "0\n")
+		|| fake_file(fake, path, "iio/events/in_temp_thresh_falling_value", "25\n")
+		|| fake_file(fake, path, "iio/events/in_temp_thresh_falling_en", "0\n")
+		|| fake_file(fake, fake->rygleds, "RYGleds/temperature", "0\n")
+		|| fake_file(fake, fake->buzzer, "buzzer/temperature", "0\n")
+		|| fake_file(fake, fake->lcd1602_temperature, "lcd1602/temperature", "0\n")
+		|| fake_file(fake, fake->lcd1602_humidity, "lcd1602/humidity", "0\n")) {
+		return -1;
+	}
+
+	fake->sample_fd = -1;
+	fake->event_pipe[0] = -1;
+	fake->event_pipe[1] = -1;
+
+	return 0;
+}
+
+static inline void fake_destroy(struct fake *fake)
+{
+	while (fake->num_created) {
+		const char *path = fake->created[--fake->num_created];
+
+		if (unlink(path) == -1) {
+			rmdir(path);
+		}
+	}
+}
+
+/* fake_attr: A threshold attribute as app.c last wrote it */
+static inline int fake_attr(struct fake *fake, const char *name)
+{
+	char path[FAKE_PATH_SIZE], buf[32];
+	ssize_t num_read;
+	int fd;
+
+	if (snprintf(path, FAKE_PATH_SIZE, "%s/%s", fake->events, name) >= FAKE_PATH_SIZE) {
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	num_read = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (num_read <= 0) {
+		return 0;
+	}
+	buf[num_read] = '\0';
+
+	return atoi(buf);
+}
+
+static inline long long fake_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* fake_event: Same conditions as dht11_events(). The code isn't looked at
+ * by app.c, the timestamp is CLOCK_MONOTONIC for its latency figures.
+ */
+static inline void fake_event(struct fake *fake, int prev, int temperature)
+{
+	struct iio_event_data event = { 0, 0 };
+	int value;
+
+	value = fake_attr(fake, "in_temp_thresh_rising_value");
+	if (fake_attr(fake, "in_temp_thresh_rising_en") && prev < value && temperature >= value) {
+		event.timestamp = fake_now();
+	}
+
+	value = fake_attr(fake, "in_temp_thresh_falling_value");
+	if (fake_attr(fake, "in_temp_thresh_falling_en") && prev > value && temperature <= value) {
+		event.timestamp = fake_now();
+	}
+
+	if (event.timestamp && write(fake->event_pipe[1], &event, sizeof(event)) == sizeof(event)) {
+		++fake->sent;
+	}
+}
+
+/* fake_step: Publish the next step of the script */
+static inline int fake_step(struct fake *fake)
+{
+	const int *step = fake->steps[fake->emitted % fake->num_steps];
+	char buf[64];
+	int len;
+
+	/* Fixed width, so a pread() racing with this never sees a shorter file */
+	len = snprintf(buf, sizeof(buf), "%4d %4d %20lld\n", step[0], step[1], fake_now());
+	if (pwrite(fake->sample_fd, buf, len, 0) != len) {
+		return -1;
+	}
+
+	if (fake->emitted) {
+		fake_event(fake, fake->prev, step[0]);
+	}
+	fake->prev = step[0];
+	++fake->emitted;
+
+	return 0;
+}
+
+static void *fake_sensor(void *arg)
+{
+	struct fake *fake = arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!fake->stop && fake->emitted != fake->max_steps) {
+		next.tv_nsec += fake->period;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_sec += 1;
+			next.tv_nsec -= 1000000000L;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+		}
+
+		if (fake->stop || fake_step(fake)) {
+			break;
+		}
+
+		if (fake->emitted == fake->max_steps) {
+			kill(getpid(), SIGTERM);
+		}
+	}
+
+	return NULL;
+}
+
+/* fake_start: Write the first sample and start stepping. Returns the event fd. */
+static inline int fake_start(struct fake *fake)
+{
+	fake->sample_fd = open(fake->sample, O_WRONLY);
+	if (fake->sample_fd == -1) {
+		return -1;
+	}
+
+	/* Events are dropped rather than block the sensor when app.c doesn't read them */
+	if (pipe(fake->event_pipe) == -1 || fcntl(fake->event_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+		return -1;
+	}
+
+	if (fake_step(fake) || pthread_create(&fake->thread, NULL, fake_sensor, fake)) {
+		return -1;
+	}
+
+	return fake->event_pipe[0];
+}
+
+/* fake_stop: app.c closes the event fd itself */
+static inline void fake_stop(struct fake *fake)
+{
+	fake->stop = 1;
+	pthread_join(fake->thread, NULL);
+
+	close(fake->event_pipe[1]);
+	close(fake->sample_fd);
+}
+
+#endif /* APP_FAKE_H */
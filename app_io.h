@@ -0,0 +1,306 @@
+/*
+ * Batched file I/O for app.c
+ *
+ * io_batch() runs a handful of reads and writes on small sysfs and event
+ * files. With a ring from io_ring_init() the whole batch is one
+ * io_uring_enter() on registered fds, otherwise it falls back to one
+ * pread()/pwrite() per request. Raw syscalls are used, liburing isn't needed.
+ * A ring belongs to one thread.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef APP_IO_H
+#define APP_IO_H
+
+#include <string.h> /* memset() */
+#include <stdint.h> /* uintptr_t */
+#include <errno.h> /* errno */
+#include <unistd.h> /* syscall(), pread(), pwrite(), close() */
+#include <sys/mman.h> /* mmap(), munmap() */
+#include <sys/uio.h> /* struct iovec */
+#include <sys/syscall.h> /* __NR_io_uring_* */
+#include <linux/io_uring.h> /* struct io_uring_params, struct io_uring_sqe */
+
+#define IO_RING_ENTRIES 4 /* Largest batch */
+#define IO_RING_FILES 4
+
+struct io_req {
+	int fd;
+	int write;
+	int stream; /* No file position, as the IIO event fd and timerfd */
+	void *buf;
+	size_t len;
+	ssize_t res; /* Bytes transferred or -errno */
+	struct iovec iov;
+};
+
+struct io_ring {
+	int fd; /* -1 for the plain syscall path */
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	int files[IO_RING_FILES]; /* Registered fds, the index is the fixed file */
+	int num_files;
+};
+
+static inline void io_req_set(struct io_req *req, int fd, int write, int stream, void *buf, size_t len)
+{
+	req->fd = fd;
+	req->write = write;
+	req->stream = stream;
+	req->buf = buf;
+	req->len = len;
+	req->res = 0;
+}
+
+/* Same numbers on every architecture, libc headers before 2019 don't have them */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#define __NR_io_uring_register 427
+#endif
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline void io_ring_exit(struct io_ring *ring)
+{
+	if (ring->fd == -1) {
+		return;
+	}
+
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) {
+		munmap(ring->sq_ptr, ring->sq_len);
+	}
+	close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* io_ring_init: Returns -1 with ring->fd == -1 if io_uring isn't there
+ * (ENOSYS before Linux 5.1) and the ring can still be used for the plain path.
+ */
+static inline int io_ring_init(struct io_ring *ring)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = io_uring_setup(IO_RING_ENTRIES, &p);
+	if (ring->fd == -1) {
+		return -1;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		io_ring_exit(ring);
+
+		return -1;
+	}
+
+	sq = ring->sq_ptr;
+	cq = ring->cq_ptr;
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+/* io_ring_files: Register fds, again whenever one of them was reopened, and
+ * none with num 0 before they are closed. The batch still works on plain
+ * fds without registration, so a failure here isn't fatal.
+ */
+static inline int io_ring_files(struct io_ring *ring, const int *fds, int num)
+{
+	int i;
+
+	if (ring->fd == -1 || num > IO_RING_FILES) {
+		return -1;
+	}
+
+	if (ring->num_files) {
+		io_uring_register(ring->fd, IORING_UNREGISTER_FILES, NULL, 0);
+		ring->num_files = 0;
+	}
+	if (!num) {
+		return 0;
+	}
+
+	if (io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, num) == -1) {
+		return -1;
+	}
+
+	for (i = 0; i < num; ++i) {
+		ring->files[i] = fds[i];
+	}
+	ring->num_files = num;
+
+	return 0;
+}
+
+static inline int io_ring_file_index(const struct io_ring *ring, int fd)
+{
+	int i;
+
+	for (i = 0; i < ring->num_files; ++i) {
+		if (ring->files[i] == fd) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* io_batch_plain: Same results as the ring, one syscall per request */
+static inline void io_batch_plain(struct io_req *reqs, int num, int link)
+{
+	int i;
+
+	for (i = 0; i < num; ++i) {
+		struct io_req *req = &reqs[i];
+
+		if (req->write) {
+			req->res = req->stream ? write(req->fd, req->buf, req->len) : pwrite(req->fd, req->buf, req->len, 0);
+		} else {
+			req->res = req->stream ? read(req->fd, req->buf, req->len) : pread(req->fd, req->buf, req->len, 0);
+		}
+		if (req->res == -1) {
+			req->res = -errno;
+
+			if (link) {
+				for (++i; i < num; ++i) {
+					reqs[i].res = -ECANCELED;
+				}
+			}
+		}
+	}
+}
+
+/* io_batch: Run num requests at offset 0, or the stream position. With link
+ * set a failed request cancels the ones after it (-ECANCELED), otherwise they
+ * are independent. Returns -1 only if the batch itself couldn't run, the
+ * outcome of every request is in its res.
+ */
+static inline int io_batch(struct io_ring *ring, struct io_req *reqs, int num, int link)
+{
+	unsigned tail, head, mask;
+	int i, index, done, ret;
+
+	if (ring->fd == -1) {
+		io_batch_plain(reqs, num, link);
+
+		return 0;
+	}
+
+	if (num > IO_RING_ENTRIES) {
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	tail = *ring->sq_tail;
+	mask = *ring->sq_mask;
+	for (i = 0; i < num; ++i) {
+		struct io_req *req = &reqs[i];
+		unsigned slot = tail & mask;
+		struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+		req->iov.iov_base = req->buf;
+		req->iov.iov_len = req->len;
+		req->res = -ECANCELED;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t)&req->iov;
+		sqe->len = 1;
+		sqe->off = 0; /* Ignored by the stream files */
+		sqe->user_data = i;
+
+		index = io_ring_file_index(ring, req->fd);
+		if (index == -1) {
+			sqe->fd = req->fd;
+		} else {
+			sqe->fd = index;
+			sqe->flags |= IOSQE_FIXED_FILE;
+		}
+		if (link && i < num - 1) {
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+
+		ring->sq_array[slot] = slot;
+		++tail;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	/* Submit and wait for all of them in one go, only wait again if interrupted */
+	do {
+		ret = io_uring_enter(ring->fd, num, num, IORING_ENTER_GETEVENTS);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		return -1;
+	}
+
+	for (done = 0;;) {
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+			if (cqe->user_data < (unsigned)num) {
+				reqs[cqe->user_data].res = cqe->res;
+			}
+			++head;
+			++done;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (done >= num) {
+			return 0;
+		}
+
+		ret = io_uring_enter(ring->fd, 0, num - done, IORING_ENTER_GETEVENTS);
+		if (ret == -1 && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+#endif /* APP_IO_H */
@@ -0,0 +1,225 @@
+/*
+ * Userspace benchmark for the DHT11 frame decoder
+ *
+ * Runs dht11_decode_frame() from rpi_dht11_decode.h, unchanged, over
+ * synthetic edge sets and reports decoded frames per second. The previous
+ * bit-array decoder is kept here as the baseline.
+ *
+ * Build: gcc -O2 -Wall -o dht11_decode_bench dht11_decode_bench.c
+ * Usage: ./dht11_decode_bench [frames] [rounds]
+ */
+
+#include <stdio.h> /* printf(), fprintf() */
+#include <stdlib.h> /* exit(), malloc(), free(), strtoul(), rand_r() */
+#include <time.h> /* clock_gettime() */
+
+#include "rpi_dht11_decode.h"
+
+#define DEFAULT_FRAMES 4096
+#define DEFAULT_ROUNDS 200
+
+/* Share of frames whose first preamble edge was missed by the IRQ handler,
+ * and of frames with an edge lost in the middle that no offset can decode.
+ */
+#define SHIFTED_PERCENT 30
+#define BROKEN_PERCENT 10
+
+struct synthetic_frame {
+	struct dht11_edges edges;
+	int num_edges;
+
+	/* The same edges in the old {s64 ts; int value} layout */
+	struct {
+		int64_t ts;
+		int value;
+	} legacy[DHT11_EDGES_PER_READ];
+};
+
+static unsigned int jitter(unsigned int *seed, unsigned int min, unsigned int max)
+{
+	return min + (unsigned int)rand_r(seed) % (max - min + 1);
+}
+
+/* make_frame: Edge timings as the driver sees them, 0-bit 22-30us, 1-bit 68-75us */
+static void make_frame(struct synthetic_frame *f, unsigned int *seed)
+{
+	unsigned int all[DHT11_EDGES_PER_READ + 1], levels[DHT11_EDGES_PER_READ + 1];
+	u8 bytes[5];
+	int i, n, skip;
+	int64_t ts;
+
+	bytes[0] = jitter(seed, 20, 90); /* hum_int */
+	bytes[1] = 0;
+	bytes[2] = jitter(seed, 0, 50); /* temp_int */
+	bytes[3] = 0;
+	bytes[4] = bytes[0] + bytes[1] + bytes[2] + bytes[3];
+
+	n = 0;
+	all[n] = 0; levels[n++] = 0; /* Response: sensor pulls low */
+	all[n] = jitter(seed, 78000, 82000); levels[n++] = 1;
+	all[n] = jitter(seed, 78000, 82000); levels[n++] = 0;
+	for (i = 0; i < DHT11_BITS_PER_READ; ++i) {
+		all[n] = jitter(seed, 48000, 55000); levels[n++] = 1;
+		if (bytes[i / 8] & (0x80 >> (i % 8))) {
+			all[n] = jitter(seed, 68000, 75000);
+		} else {
+			all[n] = jitter(seed, 22000, 30000);
+		}
+		levels[n++] = 0;
+	}
+
+	skip = 0;
+	if ((unsigned int)rand_r(seed) % 100 < SHIFTED_PERCENT) {
+		skip = 1;
+	}
+
+	f->num_edges = 0;
+	ts = 0;
+	for (i = skip; i < n; ++i) {
+		/* Drop one data edge to break synchronisation */
+		if (f->num_edges == 40 && (unsigned int)rand_r(seed) % 100 < BROKEN_PERCENT) {
+			ts += all[i];
+			continue;
+		}
+
+		ts += all[i];
+		f->edges.delta[f->num_edges] = f->num_edges ? all[i] : 0;
+		dht11_edge_set_level(&f->edges, f->num_edges, levels[i]);
+		f->legacy[f->num_edges].ts = ts;
+		f->legacy[f->num_edges].value = levels[i];
+
+		if (++f->num_edges == DHT11_EDGES_PER_READ) {
+			break;
+		}
+	}
+}
+
+/* The decoder as it was before rpi_dht11_decode.h */
+static unsigned char legacy_decode_byte(char *bits)
+{
+	unsigned char ret = 0;
+	int i;
+
+	for (i = 0; i < 8; ++i) {
+		ret <<= 1;
+
+		if (bits[i]) {
+			++ret;
+		}
+	}
+
+	return ret;
+}
+
+static int legacy_decode(const struct synthetic_frame *f, int offset, u64 *frame)
+{
+	int i, t;
+	char bits[DHT11_BITS_PER_READ];
+	unsigned char temp_int, temp_dec, hum_int, hum_dec, checksum;
+
+	for (i = 0; i < DHT11_BITS_PER_READ; ++i) {
+		t = f->legacy[offset + 2 * i + 2].ts - f->legacy[offset + 2 * i + 1].ts;
+
+		if (!f->legacy[offset + 2 * i + 1].value) {
+			return -EIO;
+		}
+
+		bits[i] = t > DHT11_THRESHOLD_IN_DECODE_FUNC;
+	}
+
+	hum_int = legacy_decode_byte(bits);
+	hum_dec = legacy_decode_byte(&bits[8]);
+	temp_int = legacy_decode_byte(&bits[16]);
+	temp_dec = legacy_decode_byte(&bits[24]);
+	checksum = legacy_decode_byte(&bits[32]);
+
+	if (((hum_int + hum_dec + temp_int + temp_dec) & 0xff) != checksum) {
+		return -EIO;
+	}
+
+	*frame = (u64)hum_int << 32 | (u64)hum_dec << 24 | (u64)temp_int << 16 | (u64)temp_dec << 8 | checksum;
+
+	return 0;
+}
+
+static int packed_decode(const struct synthetic_frame *f, int offset, u64 *frame)
+{
+	return dht11_decode_frame(&f->edges, offset, DHT11_THRESHOLD_IN_DECODE_FUNC, frame);
+}
+
+/* run: Same offset search as the driver, for every frame, rounds times */
+static void run(const char *name, int (*decode)(const struct synthetic_frame *, int, u64 *),
+		const struct synthetic_frame *frames, unsigned long num_frames, unsigned long rounds)
+{
+	struct timespec start, end;
+	unsigned long r, i, ok = 0;
+	u64 frame, sum = 0;
+	double elapsed;
+	int offset;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (r = 0; r < rounds; ++r) {
+		for (i = 0; i < num_frames; ++i) {
+			if (frames[i].num_edges < DHT11_EDGES_PER_READ - 1) {
+				continue;
+			}
+
+			offset = DHT11_EDGES_PREAMBLE + frames[i].num_edges - DHT11_EDGES_PER_READ;
+			for (; offset >= 0; --offset) {
+				if (!decode(&frames[i], offset, &frame)) {
+					++ok;
+					sum += frame;
+					break;
+				}
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%-8s %14.0f %10.1f %10lu %20llu\n", name, num_frames * rounds / elapsed,
+			elapsed * 1e9 / (num_frames * rounds), ok / rounds, (unsigned long long)sum);
+}
+
+int main(int argc, char *argv[])
+{
+	struct synthetic_frame *frames;
+	unsigned long num_frames = DEFAULT_FRAMES, rounds = DEFAULT_ROUNDS, i;
+	unsigned int seed = 1;
+
+	if (argc > 1) {
+		num_frames = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		rounds = strtoul(argv[2], NULL, 10);
+	}
+	if (num_frames == 0 || rounds == 0) {
+		fprintf(stderr, "Usage: %s [frames] [rounds]\n", argv[0]);
+
+		exit(EXIT_FAILURE);
+	}
+
+	frames = calloc(num_frames, sizeof(*frames));
+	if (frames == NULL) {
+		fprintf(stderr, "Fail to allocate %lu frames\n", num_frames);
+
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_frames; ++i) {
+		make_frame(&frames[i], &seed);
+	}
+
+	printf("edges layout: %zu bytes packed, %zu bytes legacy\n", sizeof(frames[0].edges), sizeof(frames[0].legacy));
+	printf("%-8s %14s %10s %10s %20s\n", "decoder", "frames/s", "ns/frame", "decoded", "checksum");
+
+	run("legacy", legacy_decode, frames, num_frames, rounds);
+	run("packed", packed_decode, frames, num_frames, rounds);
+
+	free(frames);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/*
+ * Offline replay of DHT11 edge traces
+ *
+ * Feeds records saved from the driver's debugfs "traces" file back through
+ * dht11_decode_frame() from rpi_dht11_decode.h and reports, per decode
+ * threshold, how many transactions decode, fail the checksum or lose
+ * synchronisation. The "+flips" column counts checksum failures that
+ * checksum-guided bit flipping repairs, and the last row replays the traces
+ * in order through the adaptive threshold model.
+ *
+ * Build: gcc -O2 -Wall -o dht11_replay dht11_replay.c
+ * Usage: cat /sys/kernel/debug/<device>/traces >> traces.bin
+ *        ./dht11_replay traces.bin [min_ns max_ns step_ns]
+ */
+
+#include <stdio.h> /* printf(), fprintf(), fopen(), fread(), fclose() */
+#include <stdlib.h> /* exit(), realloc(), free(), strtoul() */
+#include <string.h> /* strerror() */
+#include <errno.h> /* errno */
+
+#include "rpi_dht11_decode.h"
+
+#define DEFAULT_MIN_THRESHOLD 30000 /* ns */
+#define DEFAULT_MAX_THRESHOLD 70000 /* ns */
+#define DEFAULT_STEP 1000 /* ns */
+
+enum replay_result {
+	REPLAY_DECODED,
+	REPLAY_CHECKSUM,
+	REPLAY_SYNC,
+	REPLAY_TIMEOUT,
+	REPLAY_RECOVERED,
+	REPLAY_RESULTS,
+};
+
+static const char *result_names[REPLAY_RESULTS] = { "decoded", "checksum", "sync", "timeout", "+flips" };
+
+/* load_traces: Read every record, dropping those already seen in an earlier dump */
+static struct dht11_trace *load_traces(const char *path, size_t *num_traces)
+{
+	struct dht11_trace *traces = NULL, trace, *tmp;
+	size_t n = 0, i;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Fail to open file: %s (%s)\n", path, strerror(errno));
+
+		exit(EXIT_FAILURE);
+	}
+
+	while (fread(&trace, sizeof(trace), 1, fp) == 1) {
+		for (i = 0; i < n; ++i) {
+			if (traces[i].seq == trace.seq && traces[i].timestamp == trace.timestamp) {
+				break;
+			}
+		}
+		if (i < n) {
+			continue;
+		}
+
+		tmp = realloc(traces, (n + 1) * sizeof(*traces));
+		if (tmp == NULL) {
+			fprintf(stderr, "Fail to allocate %zu traces\n", n + 1);
+
+			exit(EXIT_FAILURE);
+		}
+		traces = tmp;
+		traces[n++] = trace;
+	}
+
+	fclose(fp);
+
+	*num_traces = n;
+
+	return traces;
+}
+
+/* replay: Same offset search as the driver, classified by the best failure seen.
+ * With recover set a checksum failure is retried with bit flipping against
+ * *good, and like in the driver the model (if any) and *good (if any) only
+ * follow frames that decode without repair.
+ */
+static enum replay_result replay(const struct dht11_trace *trace, u32 threshold, int recover, struct dht11_threshold_model *model, u64 *good)
+{
+	enum replay_result result = REPLAY_SYNC;
+	int offset, ret, flipped = 0;
+	u64 frame;
+
+	if (trace->num_edges < DHT11_EDGES_PER_READ - 1) {
+		return REPLAY_TIMEOUT;
+	}
+
+	offset = DHT11_EDGES_PREAMBLE + trace->num_edges - DHT11_EDGES_PER_READ;
+	for (; offset >= 0; --offset) {
+		if (recover) {
+			ret = dht11_decode_frame_recover(&trace->edges, offset, threshold, good ? *good : 0, &frame, &flipped);
+		} else {
+			ret = dht11_decode_frame(&trace->edges, offset, threshold, &frame);
+		}
+		if (ret == 0) {
+			if (model != NULL && !flipped) {
+				dht11_threshold_learn(model, &trace->edges, offset, frame);
+			}
+			if (good != NULL && !flipped) {
+				*good = frame;
+			}
+
+			return flipped ? REPLAY_RECOVERED : REPLAY_DECODED;
+		}
+		if (ret == -EBADMSG) {
+			result = REPLAY_CHECKSUM;
+		}
+	}
+
+	return result;
+}
+
+static void print_row(const char *name, const unsigned long *counts, size_t num_traces)
+{
+	printf("%12s %7.1f%% %8lu %8lu %8lu %8lu %8lu\n", name, 100.0 * (counts[REPLAY_DECODED] + counts[REPLAY_RECOVERED]) / num_traces,
+			counts[REPLAY_DECODED], counts[REPLAY_CHECKSUM], counts[REPLAY_SYNC], counts[REPLAY_TIMEOUT], counts[REPLAY_RECOVERED]);
+}
+
+int main(int argc, char *argv[])
+{
+	struct dht11_trace *traces;
+	struct dht11_threshold_model model;
+	char name[16];
+	unsigned long min = DEFAULT_MIN_THRESHOLD, max = DEFAULT_MAX_THRESHOLD, step = DEFAULT_STEP, threshold;
+	unsigned long counts[REPLAY_RESULTS], recorded[REPLAY_RESULTS] = { 0 };
+	u64 good;
+	size_t num_traces, i;
+	int r;
+
+	if (argc != 2 && argc != 5) {
+		fprintf(stderr, "Usage: %s traces.bin [min_ns max_ns step_ns]\n", argv[0]);
+
+		exit(EXIT_FAILURE);
+	}
+
+	if (argc == 5) {
+		min = strtoul(argv[2], NULL, 10);
+		max = strtoul(argv[3], NULL, 10);
+		step = strtoul(argv[4], NULL, 10);
+	}
+	if (step == 0 || min > max) {
+		fprintf(stderr, "Invalid threshold range: %lu..%lu step %lu\n", min, max, step);
+
+		exit(EXIT_FAILURE);
+	}
+
+	traces = load_traces(argv[1], &num_traces);
+	if (num_traces == 0) {
+		fprintf(stderr, "No traces in %s\n", argv[1]);
+
+		exit(EXIT_FAILURE);
+	}
+
+	/* What the driver reported with the threshold it used at the time */
+	for (i = 0; i < num_traces; ++i) {
+		++recorded[replay(&traces[i], traces[i].threshold, 0, NULL, NULL)];
+	}
+
+	printf("%zu traces\n", num_traces);
+	printf("as recorded:");
+	for (r = 0; r < REPLAY_RECOVERED; ++r) {
+		printf(" %s %lu", result_names[r], recorded[r]);
+	}
+	printf("\n\n");
+
+	/* Columns besides +flips are without recovery, +flips is what it adds */
+	printf("%12s %8s %8s %8s %8s %8s %8s\n", "threshold_ns", "success", result_names[0], result_names[1], result_names[2], result_names[3], result_names[4]);
+
+	for (threshold = min; threshold <= max; threshold += step) {
+		for (r = 0; r < REPLAY_RESULTS; ++r) {
+			counts[r] = 0;
+		}
+		good = 0;
+
+		for (i = 0; i < num_traces; ++i) {
+			r = replay(&traces[i], threshold, 0, NULL, &good);
+			if (r == REPLAY_CHECKSUM && replay(&traces[i], threshold, 1, NULL, &good) == REPLAY_RECOVERED) {
+				r = REPLAY_RECOVERED;
+			}
+			++counts[r];
+		}
+
+		snprintf(name, sizeof(name), "%lu", threshold);
+		print_row(name, counts, num_traces);
+	}
+
+	for (r = 0; r < REPLAY_RESULTS; ++r) {
+		counts[r] = 0;
+	}
+
+	dht11_threshold_init(&model);
+	good = 0;
+	for (i = 0; i < num_traces; ++i) {
+		++counts[replay(&traces[i], dht11_threshold(&model), 1, &model, &good)];
+	}
+
+	print_row("adaptive", counts, num_traces);
+	printf("adaptive threshold settled at %u ns\n", dht11_threshold(&model));
+
+	free(traces);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/*
+ * DHT11 acquisition stress test
+ *
+ * Reads in_sample on demand under no load, CPU load and timer interrupt load,
+ * once with acquisition_mode "irq" and once with "poll", and reports how many
+ * reads decode. Background sampling is switched off for the run.
+ *
+ * Build: gcc -O2 -Wall -pthread -o dht11_stress dht11_stress.c
+ * Usage: ./dht11_stress [iio device dir] [seconds per run] [load threads]
+ */
+
+#include <stdio.h> /* printf(), fprintf(), snprintf() */
+#include <stdlib.h> /* exit(), strtoul() */
+#include <string.h> /* strerror(), strlen() */
+#include <errno.h> /* errno */
+#include <fcntl.h> /* open() */
+#include <unistd.h> /* pread(), write(), close(), sysconf() */
+#include <time.h> /* clock_gettime(), nanosleep() */
+#include <pthread.h> /* pthread_create(), pthread_join() */
+
+#define DEFAULT_DEVICE_DIR "/sys/bus/iio/devices/iio:device0"
+#define DEFAULT_SECONDS 120
+#define READ_INTERVAL_MS 2100 /* Just past the driver's 2s cache, every read is a new frame */
+#define BUF_SIZE 64
+
+enum load {
+	LOAD_NONE,
+	LOAD_CPU,
+	LOAD_IRQ,
+	LOADS,
+};
+
+static const char *load_names[LOADS] = { "idle", "cpu", "irq" };
+static const char *modes[] = { "irq", "poll" };
+
+static volatile int stop;
+
+/* cpu_hog: Keep a CPU busy so the sensor work competes for it */
+static void *cpu_hog(void *arg)
+{
+	volatile unsigned long n = 0;
+
+	(void)arg;
+	while (!stop) {
+		++n;
+	}
+
+	return NULL;
+}
+
+/* irq_hog: Short sleeps, every one ends in a timer interrupt */
+static void *irq_hog(void *arg)
+{
+	struct timespec ts = { 0, 20000 };
+
+	(void)arg;
+	while (!stop) {
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+static void write_attr(const char *dir, const char *name, const char *value)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Fail to open file: %s (%s)\n", path, strerror(errno));
+
+		exit(EXIT_FAILURE);
+	}
+
+	if (write(fd, value, strlen(value)) < 0) {
+		fprintf(stderr, "Fail to write %s to %s (%s)\n", value, path, strerror(errno));
+		close(fd);
+
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* run: One mode under one load, counts successful reads and failures by errno */
+static void run(int fd, const char *mode, enum load load, unsigned long seconds, unsigned long threads)
+{
+	struct timespec interval = { READ_INTERVAL_MS / 1000, (READ_INTERVAL_MS % 1000) * 1000000L };
+	unsigned long ok = 0, eio = 0, etimedout = 0, other = 0, total, i;
+	pthread_t tids[64];
+	char buf[BUF_SIZE];
+	double start, t, worst = 0;
+
+	stop = 0;
+	for (i = 0; load != LOAD_NONE && i < threads; ++i) {
+		if (pthread_create(&tids[i], NULL, load == LOAD_CPU ? cpu_hog : irq_hog, NULL)) {
+			fprintf(stderr, "Fail to create load thread\n");
+
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	start = now();
+	while (now() - start < seconds) {
+		t = now();
+		if (pread(fd, buf, sizeof(buf) - 1, 0) > 0) {
+			++ok;
+		} else if (errno == EIO) {
+			++eio;
+		} else if (errno == ETIMEDOUT) {
+			++etimedout;
+		} else {
+			++other;
+		}
+		t = now() - t;
+		worst = t > worst ? t : worst;
+
+		nanosleep(&interval, NULL);
+	}
+
+	stop = 1;
+	for (i = 0; load != LOAD_NONE && i < threads; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	total = ok + eio + etimedout + other;
+	printf("%-5s %-5s %6lu %7.1f%% %6lu %9lu %6lu %9.1f\n", mode, load_names[load], total,
+			total ? 100.0 * ok / total : 0.0, eio, etimedout, other, worst * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = DEFAULT_DEVICE_DIR;
+	unsigned long seconds = DEFAULT_SECONDS, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	char path[256];
+	unsigned int m;
+	int fd, load;
+
+	if (argc > 1) {
+		dir = argv[1];
+	}
+	if (argc > 2) {
+		seconds = strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		threads = strtoul(argv[3], NULL, 10);
+	}
+	if (seconds == 0 || threads == 0 || threads > 64) {
+		fprintf(stderr, "Usage: %s [iio device dir] [seconds per run] [load threads, 1-64]\n", argv[0]);
+
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(path, sizeof(path), "%s/in_sample", dir);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Fail to open file: %s (%s)\n", path, strerror(errno));
+
+		exit(EXIT_FAILURE);
+	}
+
+	/* On-demand reads only, background sampling would hide the failures */
+	write_attr(dir, "sampling_frequency", "0");
+
+	printf("%-5s %-5s %6s %8s %6s %9s %6s %9s\n", "mode", "load", "reads", "success", "EIO", "ETIMEDOUT", "other", "worst_ms");
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+		write_attr(dir, "acquisition_mode", modes[m]);
+
+		for (load = LOAD_NONE; load < LOADS; ++load) {
+			run(fd, modes[m], load, seconds, threads);
+		}
+	}
+
+	write_attr(dir, "acquisition_mode", "irq");
+	close(fd);
+
+	return EXIT_SUCCESS;
+}
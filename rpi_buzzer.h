@@ -0,0 +1,55 @@
+/*
+ * Buzzer tone sequences
+ *
+ * Shared between rpi_buzzer_driver.c and userspace. /dev/my_buzzer holds a
+ * ring of struct buzzer_step that a timer in the driver plays one after the
+ * other, so a whole alert pattern is queued at once and its timing stays in
+ * the kernel. Steps get in either by write() of whole structs, which starts
+ * playing them, or through mmap() of the struct buzzer_ring page: fill
+ * steps[head % BUZZER_RING_STEPS], store head + 1 (release) for each step,
+ * then BUZZER_PLAY. A sequence plays over the temperature alarm, which
+ * resumes after it. write() and the mapping exclude each other: write()
+ * fails with EBUSY while the ring is mapped, mmap() while a write() runs.
+ * Only one process should fill a mapped ring.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RPI_BUZZER_H
+#define RPI_BUZZER_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+typedef uint32_t u32;
+#endif
+
+#define BUZZER_FREQUENCY_MIN 20 /* Hz */
+#define BUZZER_FREQUENCY_MAX 20000
+#define BUZZER_STEP_MAX 10000 /* ms */
+
+#define BUZZER_RING_STEPS 256 /* Power of 2 */
+
+/* Frequencies out of range are clamped, 0 is a rest. The duration is clamped to 1..BUZZER_STEP_MAX. */
+struct buzzer_step {
+	u32 frequency; /* Hz */
+	u32 duration; /* ms */
+};
+
+struct buzzer_ring {
+	u32 head; /* Next step to fill, written by write() or the mapping, never both */
+	u32 tail; /* Next step to play, only written by the driver */
+	struct buzzer_step steps[BUZZER_RING_STEPS];
+};
+
+#define BUZZER_PLAY _IO('B', 0) /* Play the steps up to head */
+#define BUZZER_FLUSH _IO('B', 1) /* Drop the steps not played yet and stop */
+
+#endif /* RPI_BUZZER_H */
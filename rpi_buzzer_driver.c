@@ -1,10 +1,22 @@
 #include <linux/module.h>
 #include <linux/platform_device.h> /* platform_driver_register(), platform_set_drvdata() */
-#include <linux/io.h> /* ioremap(), iowrite32() */
 #include <linux/of.h> /* of_property_read_string() */
 #include <linux/miscdevice.h>
-#include <linux/delay.h>
-#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h> /* vmalloc_user(), remap_vmalloc_range() */
+#include <linux/uaccess.h> /* copy_from_user() */
+#include <linux/wait.h>
+#include <linux/mutex.h>
+
+#include "rpi_dht11.h"
+#include "rpi_buzzer.h"
+#include "rpi_gpio.h"
+
+#define CREATE_TRACE_POINTS
+#define RPI_TRACE_BUZZER
+#include "rpi_trace.h"
 
 struct buzzer_dev
 {
@@ -12,57 +24,485 @@ struct buzzer_dev
 	const char * buzzer_name; /* Stores "label" string */
 };
 
-#define BCM2710_PERI_BASE 0x3F000000
-#define GPIO_BASE (BCM2710_PERI_BASE + 0x200000) /* GPIO Controller */
-
 #define GPIO_18 18
 
 /* To operate a buzzer */
 #define GPIO_18_INDEX 1 << (GPIO_18 % 32)
 
-/* Select the output function */
-#define GPIO_18_FUNC 1 << ((GPIO_18 % 10) * 3)
-
-/* Mask the GPIO function */
-#define FSEL_18_MASK 0b111 << ((GPIO_18 % 10) * 3) /* buzzer since bit 24 (FSEL18) */
+/* Sounds above 30, as a square wave of frequency and duty. With a cadence it
+ * beeps: on for cadence_on ms, off for cadence_off ms. A sequence from
+ * rpi_buzzer.h plays over it.
+ */
+#define BUZZER_TEMPERATURE 30
+#define BUZZER_FREQUENCY 500 /* Hz, 1 ms high and 1 ms low */
+#define BUZZER_DUTY 50 /* % */
 
-#define GPIO_SET_FUNCTION_18_BUZZER (GPIO_18_FUNC)
-#define GPIO_MASK_18_BUZZER (FSEL_18_MASK)
-#define GPIO_SET_18_BUZZER (GPIO_18_INDEX)
-
-#define GPFSEL1 GPIO_BASE + 0x04
-#define GPSET0 GPIO_BASE + 0x1C
-#define GPCLR0 GPIO_BASE + 0x28
+#define TONE_RUNNING 0 /* Bit of tone_flags, the hrtimer is queued or running */
 
 #define CLASS_NAME "buzzer_class"
 #define DEVICE_NAME "buzzer_dev"
 
-/* Declear __iomem pointers that will keep virtual addresses */
-static void __iomem *GPFSEL1_V;
-static void __iomem *GPSET0_V;
-static void __iomem *GPCLR0_V;
+static char *gpio_backend = "mmio";
+module_param(gpio_backend, charp, 0444);
+MODULE_PARM_DESC(gpio_backend, "mmio (BCM2837 registers), gpiod (buzzer-gpios in DT) or mock");
+
+static const unsigned int buzzer_pins[] = { GPIO_18 };
+
+static struct rpi_gpio buzzer_gpio = {
+	.name = "buzzer",
+	.con_id = "buzzer",
+	.pins = buzzer_pins,
+	.num_pins = ARRAY_SIZE(buzzer_pins),
+};
 
 static int Temperature = 0;
 
+static unsigned int tone_frequency = BUZZER_FREQUENCY;
+static unsigned int tone_duty = BUZZER_DUTY;
+static unsigned int cadence_on, cadence_off; /* ms, cadence_off 0 sounds without a break */
+
+static struct hrtimer tone_timer;
+static unsigned long tone_flags;
+static DEFINE_SPINLOCK(tone_lock); /* The tone state below, against buzzer_tone_start() */
+static bool tone_high;
+static bool tone_silent; /* In the off part of the cadence */
+static u64 silent_until; /* ns, end of the current part of the cadence */
+
+/* Sequencer, seq_lock protects all but the page itself */
+static struct buzzer_ring *buzzer_ring; /* Page mapped by userspace */
+static struct hrtimer seq_timer;
+static DEFINE_SPINLOCK(seq_lock);
+static DEFINE_MUTEX(seq_write_lock); /* Between write() calls, and against mmap() */
+static atomic_t seq_mappings = ATOMIC_INIT(0); /* write() is refused while the ring is mapped */
+static DECLARE_WAIT_QUEUE_HEAD(seq_wait); /* write() on a full ring */
+static u32 seq_tail; /* Ours, ring->tail is only a copy for userspace */
+static bool seq_running; /* Read by buzzer_tone() without the lock */
+
+/* Between probe and remove, under both seq_lock and tone_lock */
+static bool buzzer_bound;
+static struct device_node *buzzer_sensor; /* DHT11 followed, "dht11" in DT, NULL for sysfs only */
+static unsigned int seq_frequency; /* Of the step being played, 0 for a rest */
+
+/* Time spent in buzzer_tone() while the alarm sounds, in debugfs */
+static DEFINE_SPINLOCK(tone_stats_lock);
+static u64 tone_callbacks, tone_callback_ns, tone_callback_max_ns;
+static u64 tone_active_ns, tone_start_ns;
+static struct dentry *buzzer_debugfs;
+
 static struct class *buzzer_class;
 static struct device *buzzer_dev;
 dev_t dev;
 
-static void buzzer_work(struct work_struct *unused);
-static DECLARE_WORK(work, buzzer_work);
+static bool buzzer_hot(void)
+{
+	return READ_ONCE(Temperature) > BUZZER_TEMPERATURE;
+}
+
+/* buzzer_frequency: What buzzer_tone() plays, 0 for silence */
+static unsigned int buzzer_frequency(void)
+{
+	if (READ_ONCE(seq_running)) {
+		return READ_ONCE(seq_frequency);
+	}
+
+	return buzzer_hot() ? READ_ONCE(tone_frequency) : 0;
+}
+
+/* buzzer_tone_account: stop ends the active time started by buzzer_tone_start() */
+static void buzzer_tone_account(u64 start, bool stop)
+{
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+
+	spin_lock_irqsave(&tone_stats_lock, flags);
+
+	++tone_callbacks;
+	tone_callback_ns += now - start;
+	if (now - start > tone_callback_max_ns) {
+		tone_callback_max_ns = now - start;
+	}
+	if (stop) {
+		tone_active_ns += now - tone_start_ns;
+	}
+
+	spin_unlock_irqrestore(&tone_stats_lock, flags);
+}
+
+/* buzzer_tone: One edge of the square wave per call, nothing runs in between */
+static enum hrtimer_restart buzzer_tone(struct hrtimer *timer)
+{
+	u64 start = ktime_get_ns();
+	u64 period, high, next;
+	unsigned int frequency, on, off;
+
+	spin_lock(&tone_lock);
+
+	frequency = buzzer_frequency();
+	if (!frequency) {
+		rpi_gpio_clear(&buzzer_gpio, GPIO_18_INDEX);
+		tone_high = false;
+
+		/* Don't miss a buzzer_tone_update() that still saw us running */
+		clear_bit(TONE_RUNNING, &tone_flags);
+		smp_mb__after_atomic();
+		frequency = buzzer_frequency();
+		if (!frequency || test_and_set_bit(TONE_RUNNING, &tone_flags)) {
+			spin_unlock(&tone_lock);
+			buzzer_tone_account(start, true);
+
+			return HRTIMER_NORESTART;
+		}
+	}
+
+	/* The steps of a sequence are its cadence */
+	on = READ_ONCE(cadence_on);
+	off = READ_ONCE(seq_running) ? 0 : READ_ONCE(cadence_off);
+	if (!off) {
+		tone_silent = false;
+	} else if (start >= silent_until) {
+		tone_silent = !tone_silent;
+		silent_until = start + (u64)(tone_silent ? off : on) * NSEC_PER_MSEC;
+	}
+
+	if (tone_silent) {
+		rpi_gpio_clear(&buzzer_gpio, GPIO_18_INDEX);
+		tone_high = false;
+		next = silent_until - start;
+	} else {
+		period = NSEC_PER_SEC / frequency;
+		high = period * READ_ONCE(tone_duty) / 100;
+
+		tone_high = !tone_high;
+		if (tone_high) {
+			rpi_gpio_set(&buzzer_gpio, GPIO_18_INDEX);
+			trace_buzzer_pulse(READ_ONCE(Temperature));
+			next = high;
+		} else {
+			rpi_gpio_clear(&buzzer_gpio, GPIO_18_INDEX);
+			next = period - high;
+		}
+	}
+
+	hrtimer_forward_now(timer, ns_to_ktime(next));
 
-static void buzzer_work(struct work_struct *unused)
+	spin_unlock(&tone_lock);
+	buzzer_tone_account(start, false);
+
+	return HRTIMER_RESTART;
+}
+
+static void buzzer_tone_start(void)
+{
+	unsigned long flags;
+
+	if (test_and_set_bit(TONE_RUNNING, &tone_flags)) {
+		return;
+	}
+
+	/* A buzzer_tone() that just gave up TONE_RUNNING may still be running,
+	 * it is done with the state once it lets go of tone_lock. The first
+	 * call starts the on part of the cadence.
+	 */
+	spin_lock_irqsave(&tone_lock, flags);
+	if (!buzzer_bound) {
+		clear_bit(TONE_RUNNING, &tone_flags);
+		spin_unlock_irqrestore(&tone_lock, flags);
+
+		return;
+	}
+
+	spin_lock(&tone_stats_lock);
+	tone_start_ns = ktime_get_ns();
+	spin_unlock(&tone_stats_lock);
+
+	tone_high = false;
+	tone_silent = true;
+	silent_until = 0;
+	hrtimer_start(&tone_timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&tone_lock, flags);
+}
+
+/* buzzer_tone_stop: Silence it for good, before the pin goes away */
+static void buzzer_tone_stop(void)
+{
+	unsigned long flags;
+
+	hrtimer_cancel(&seq_timer);
+	WRITE_ONCE(seq_running, false);
+
+	WRITE_ONCE(Temperature, 0);
+	hrtimer_cancel(&tone_timer);
+
+	if (test_and_clear_bit(TONE_RUNNING, &tone_flags)) {
+		spin_lock_irqsave(&tone_stats_lock, flags);
+		tone_active_ns += ktime_get_ns() - tone_start_ns;
+		spin_unlock_irqrestore(&tone_stats_lock, flags);
+	}
+
+	rpi_gpio_clear(&buzzer_gpio, GPIO_18_INDEX);
+}
+
+/* buzzer_tone_update: After anything buzzer_frequency() looks at changed */
+static void buzzer_tone_update(void)
+{
+	smp_mb(); /* Pairs with buzzer_tone() clearing TONE_RUNNING */
+
+	if (buzzer_frequency()) {
+		buzzer_tone_start();
+	}
+}
+
+static void buzzer_set_temperature(int temperature)
+{
+	WRITE_ONCE(Temperature, temperature);
+
+	buzzer_tone_update();
+}
+
+/* buzzer_seq_next: Take the next step off the ring, with seq_lock held.
+ * The page is shared with userspace, so every step is checked here.
+ */
+static bool buzzer_seq_next(struct buzzer_step *step)
 {
-	iowrite32(GPIO_18_INDEX, GPSET0_V);
-	mdelay(1);
-	iowrite32(GPIO_18_INDEX, GPCLR0_V);
-	mdelay(1);
+	u32 head = smp_load_acquire(&buzzer_ring->head);
+	const struct buzzer_step *next;
 
-	if (Temperature > 30) {
-		schedule_work(&work);
+	/* A head more than the ring ahead is garbage, start over from it */
+	if (head - seq_tail > BUZZER_RING_STEPS) {
+		seq_tail = head;
+	}
+	if (head == seq_tail) {
+		return false;
+	}
+
+	next = &buzzer_ring->steps[seq_tail % BUZZER_RING_STEPS];
+	step->frequency = READ_ONCE(next->frequency);
+	step->duration = READ_ONCE(next->duration);
+	smp_store_release(&buzzer_ring->tail, ++seq_tail);
+
+	if (step->frequency) {
+		step->frequency = clamp_t(u32, step->frequency, BUZZER_FREQUENCY_MIN, BUZZER_FREQUENCY_MAX);
+	}
+	step->duration = clamp_t(u32, step->duration, 1, BUZZER_STEP_MAX);
+
+	return true;
+}
+
+/* buzzer_seq: Start the next step, until the ring is empty */
+static enum hrtimer_restart buzzer_seq(struct hrtimer *timer)
+{
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	struct buzzer_step step;
+	unsigned long flags;
+
+	spin_lock_irqsave(&seq_lock, flags);
+	if (buzzer_seq_next(&step)) {
+		WRITE_ONCE(seq_frequency, step.frequency);
+		hrtimer_forward_now(timer, ms_to_ktime(step.duration));
+	} else {
+		WRITE_ONCE(seq_running, false);
+		WRITE_ONCE(seq_frequency, 0);
+		ret = HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&seq_lock, flags);
+
+	wake_up(&seq_wait);
+	buzzer_tone_update();
+
+	return ret;
+}
+
+/* buzzer_seq_start: -ENODEV once the device is unbound */
+static int buzzer_seq_start(void)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&seq_lock, flags);
+	if (!buzzer_bound) {
+		ret = -ENODEV;
+	} else if (!seq_running && smp_load_acquire(&buzzer_ring->head) != seq_tail) {
+		WRITE_ONCE(seq_running, true);
+		hrtimer_start(&seq_timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&seq_lock, flags);
+
+	return ret;
+}
+
+/* buzzer_set_bound: Nothing starts the sequencer or the tone while unbound */
+static void buzzer_set_bound(bool bound)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&seq_lock, flags);
+	spin_lock(&tone_lock);
+	buzzer_bound = bound;
+	spin_unlock(&tone_lock);
+	spin_unlock_irqrestore(&seq_lock, flags);
+}
+
+static void buzzer_seq_flush(void)
+{
+	unsigned long flags;
+
+	hrtimer_cancel(&seq_timer);
+
+	spin_lock_irqsave(&seq_lock, flags);
+	seq_tail = READ_ONCE(buzzer_ring->head);
+	smp_store_release(&buzzer_ring->tail, seq_tail);
+	WRITE_ONCE(seq_running, false);
+	WRITE_ONCE(seq_frequency, 0);
+	spin_unlock_irqrestore(&seq_lock, flags);
+
+	wake_up(&seq_wait);
+	buzzer_tone_update();
+}
+
+/* buzzer_seq_free: From seq_tail, the mapped tail is only a copy userspace can scribble on */
+static u32 buzzer_seq_free(void)
+{
+	unsigned long flags;
+	u32 used;
+
+	spin_lock_irqsave(&seq_lock, flags);
+	used = READ_ONCE(buzzer_ring->head) - seq_tail;
+	spin_unlock_irqrestore(&seq_lock, flags);
+
+	return used < BUZZER_RING_STEPS ? BUZZER_RING_STEPS - used : 0;
+}
+
+/* buzzer_write: Queue whole struct buzzer_step and play them. Blocks while
+ * the ring is full, unless O_NONBLOCK, and returns what fitted.
+ */
+static ssize_t buzzer_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	size_t num_steps = count / sizeof(struct buzzer_step);
+	u32 head, num_free, i;
+	ssize_t ret;
+
+	if (!num_steps || count % sizeof(struct buzzer_step)) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&seq_write_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	/* head belongs to the mapping while there is one */
+	if (atomic_read(&seq_mappings)) {
+		mutex_unlock(&seq_write_lock);
+
+		return -EBUSY;
+	}
+
+	/* Steps left by a mapping without BUZZER_PLAY would never drain */
+	ret = buzzer_seq_start();
+	if (ret) {
+		mutex_unlock(&seq_write_lock);
+
+		return ret;
+	}
+
+	if (file->f_flags & O_NONBLOCK) {
+		ret = buzzer_seq_free() ? 0 : -EAGAIN;
+	} else {
+		ret = wait_event_interruptible(seq_wait, buzzer_seq_free());
+	}
+	if (ret) {
+		mutex_unlock(&seq_write_lock);
+
+		return ret;
+	}
+
+	head = READ_ONCE(buzzer_ring->head);
+	num_free = buzzer_seq_free();
+	if (num_steps > num_free) {
+		num_steps = num_free;
+	}
+
+	for (i = 0; i < num_steps; ++i) {
+		if (copy_from_user(&buzzer_ring->steps[(head + i) % BUZZER_RING_STEPS], buf + i * sizeof(struct buzzer_step), sizeof(struct buzzer_step))) {
+			break;
+		}
+	}
+	smp_store_release(&buzzer_ring->head, head + i);
+
+	mutex_unlock(&seq_write_lock);
+
+	if (!i) {
+		return -EFAULT;
+	}
+
+	ret = buzzer_seq_start();
+	if (ret) {
+		return ret;
+	}
+
+	return i * sizeof(struct buzzer_step);
+}
+
+static long buzzer_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case BUZZER_PLAY:
+		return buzzer_seq_start();
+	case BUZZER_FLUSH:
+		buzzer_seq_flush();
+
+		return 0;
+	default:
+		return -ENOTTY;
 	}
 }
 
+static void buzzer_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&seq_mappings);
+}
+
+static void buzzer_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&seq_mappings);
+}
+
+static const struct vm_operations_struct buzzer_vm_ops = {
+	.open = buzzer_vm_open,
+	.close = buzzer_vm_close,
+};
+
+/* buzzer_mmap: The ring page, shared. Refused during a write(), which then
+ * owns head, and write() is refused until the last mapping goes. Only tried,
+ * a write() faulting on its buffer needs the mmap_sem held here.
+ */
+static int buzzer_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (!mutex_trylock(&seq_write_lock)) {
+		return -EBUSY;
+	}
+
+	ret = remap_vmalloc_range(vma, buzzer_ring, vma->vm_pgoff);
+	if (!ret) {
+		vma->vm_ops = &buzzer_vm_ops;
+		buzzer_vm_open(vma);
+	}
+
+	mutex_unlock(&seq_write_lock);
+
+	return ret;
+}
+
+static const struct file_operations buzzer_fops = {
+	.owner = THIS_MODULE,
+	.write = buzzer_write,
+	.unlocked_ioctl = buzzer_ioctl,
+	.compat_ioctl = buzzer_ioctl, /* No pointers in the arguments */
+	.mmap = buzzer_mmap,
+	.llseek = no_llseek,
+};
+
 static ssize_t set_temperature(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
 	long temperature_value = 0;
@@ -73,11 +513,7 @@ static ssize_t set_temperature(struct device *dev, struct device_attribute *attr
 		return -EINVAL;
 	}
 
-	Temperature = temperature_value;
-
-	if (Temperature > 30) {
-		schedule_work(&work);
-	}
+	buzzer_set_temperature(temperature_value);
 
 	pr_info("[+] set_temperature exit\n");
 
@@ -85,24 +521,188 @@ static ssize_t set_temperature(struct device *dev, struct device_attribute *attr
 }
 static DEVICE_ATTR(temperature, S_IWUSR, NULL, set_temperature);
 
+static ssize_t show_frequency(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(tone_frequency));
+}
+
+static ssize_t set_frequency(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int frequency;
+
+	if (kstrtouint(buf, 10, &frequency) < 0 || frequency < BUZZER_FREQUENCY_MIN || frequency > BUZZER_FREQUENCY_MAX) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(tone_frequency, frequency);
+
+	return count;
+}
+static DEVICE_ATTR(frequency, S_IRUGO | S_IWUSR, show_frequency, set_frequency);
+
+static ssize_t show_duty(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(tone_duty));
+}
+
+static ssize_t set_duty(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int duty;
+
+	if (kstrtouint(buf, 10, &duty) < 0 || duty < 1 || duty > 99) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(tone_duty, duty);
+
+	return count;
+}
+static DEVICE_ATTR(duty, S_IRUGO | S_IWUSR, show_duty, set_duty);
+
+/* cadence: "on off" in ms, "0 0" sounds without a break */
+static ssize_t show_cadence(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u %u\n", READ_ONCE(cadence_on), READ_ONCE(cadence_off));
+}
+
+static ssize_t set_cadence(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int on, off;
+
+	if (sscanf(buf, "%u %u", &on, &off) != 2 || (off && !on)) {
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(cadence_on, on);
+	WRITE_ONCE(cadence_off, off);
+
+	return count;
+}
+static DEVICE_ATTR(cadence, S_IRUGO | S_IWUSR, show_cadence, set_cadence);
+
+static struct device_attribute *buzzer_attrs[] = {
+	&dev_attr_temperature,
+	&dev_attr_frequency,
+	&dev_attr_duty,
+	&dev_attr_cadence,
+};
+
+/* buzzer_stats_show: The callback time doesn't include the interrupt entry and exit around it */
+static int buzzer_stats_show(struct seq_file *s, void *unused)
+{
+	u64 callbacks, callback_ns, callback_max_ns, active_ns;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tone_stats_lock, flags);
+	callbacks = tone_callbacks;
+	callback_ns = tone_callback_ns;
+	callback_max_ns = tone_callback_max_ns;
+	active_ns = tone_active_ns;
+	if (test_bit(TONE_RUNNING, &tone_flags)) {
+		active_ns += ktime_get_ns() - tone_start_ns;
+	}
+	spin_unlock_irqrestore(&tone_stats_lock, flags);
+
+	seq_printf(s, "callbacks %llu\n", callbacks);
+	seq_printf(s, "callback_ns %llu\n", callback_ns);
+	seq_printf(s, "callback_max_ns %llu\n", callback_max_ns);
+	seq_printf(s, "active_ns %llu\n", active_ns);
+	seq_printf(s, "cpu_ppm %llu\n", active_ns ? div64_u64(callback_ns * 1000000, active_ns) : 0);
+
+	return 0;
+}
+
+static int buzzer_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, buzzer_stats_show, inode->i_private);
+}
+
+/* buzzer_stats_clear: Any write starts a new measurement */
+static ssize_t buzzer_stats_clear(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tone_stats_lock, flags);
+	tone_callbacks = 0;
+	tone_callback_ns = 0;
+	tone_callback_max_ns = 0;
+	tone_active_ns = 0;
+	tone_start_ns = ktime_get_ns();
+	spin_unlock_irqrestore(&tone_stats_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations buzzer_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = buzzer_stats_open,
+	.read = seq_read,
+	.write = buzzer_stats_clear,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* buzzer_dht11_notify: Start sounding from the frame that crossed 30, not from app.c */
+static int buzzer_dht11_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+	const struct dht11_frame *frame = data;
+
+	if (!dht11_frame_from(frame, READ_ONCE(buzzer_sensor))) {
+		return NOTIFY_OK;
+	}
+
+	buzzer_set_temperature(frame->temperature);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block buzzer_dht11_notifier = {
+	.notifier_call = buzzer_dht11_notify,
+};
+
 static int __init buzzer_probe(struct platform_device *pdev)
 {
 	struct buzzer_dev *buzzer_device;
+	struct device_node *sensor;
 	int ret_val;
 
 	pr_info("[+] buzzer_probe enter\n");
 
+	/* The pin is global, there is only one buzzer */
+	if (READ_ONCE(buzzer_gpio.ops)) {
+		return -EBUSY;
+	}
+
 	buzzer_device = devm_kzalloc(&pdev->dev, sizeof(struct buzzer_dev), GFP_KERNEL);
 	buzzer_device->buzzer_misc_device.minor = MISC_DYNAMIC_MINOR;
 	buzzer_device->buzzer_misc_device.name = "my_buzzer";
+	buzzer_device->buzzer_misc_device.fops = &buzzer_fops;
+
+	sensor = dht11_sensor_get(&pdev->dev);
+	if (IS_ERR(sensor)) {
+		return PTR_ERR(sensor);
+	}
+
+	ret_val = rpi_gpio_init(&buzzer_gpio, &pdev->dev, gpio_backend);
+	if (ret_val) {
+		return ret_val;
+	}
+
+	buzzer_set_bound(true);
 
 	ret_val = misc_register(&buzzer_device->buzzer_misc_device);
 	if (ret_val) {
+		buzzer_set_bound(false);
+		rpi_gpio_exit(&buzzer_gpio);
+
 		return ret_val;
 	}
 
 	platform_set_drvdata(pdev, buzzer_device);
 
+	/* Only compared with the frame's, so remove can clear it before devm puts it */
+	WRITE_ONCE(buzzer_sensor, sensor);
+
 	pr_info("[+] buzzer_probe exit\n");
 
 	return 0;
@@ -116,6 +716,15 @@ static int __exit buzzer_remove(struct platform_device *pdev)
 
 	misc_deregister(&buzzer_device->buzzer_misc_device);
 
+	WRITE_ONCE(buzzer_sensor, NULL);
+
+	/* An fd opened before misc_deregister() or a write to temperature can't
+	 * start the sequencer or the tone once unbound
+	 */
+	buzzer_set_bound(false);
+	buzzer_tone_stop();
+	rpi_gpio_exit(&buzzer_gpio); /* Clear buzzer */
+
 	pr_info("[+] buzzer_remove exit\n");
 
 	return 0;
@@ -140,39 +749,37 @@ static struct platform_driver buzzer_platform_driver = {
 static int buzzer_init(void)
 {
 	int ret_val;
-	u32 GPFSEL_read, GPFSEL_write;
 	dev_t dev_no;
 	int Major;
+	size_t i;
 
 	pr_info("[+] buzzer_init enter\n");
 
+	hrtimer_init(&tone_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tone_timer.function = buzzer_tone;
+	hrtimer_init(&seq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	seq_timer.function = buzzer_seq;
+
+	/* Freed by buzzer_exit(), a mapping keeps the module loaded */
+	BUILD_BUG_ON(sizeof(struct buzzer_ring) > PAGE_SIZE);
+	buzzer_ring = vmalloc_user(sizeof(struct buzzer_ring));
+	if (!buzzer_ring) {
+		return -ENOMEM;
+	}
+
 	ret_val = platform_driver_register(&buzzer_platform_driver);
 	if (ret_val != 0) {
 		pr_err("[+] Platform value returned %d\n", ret_val);
 
-		return ret_val;
+		goto err_ring;
 	}
 
-	GPFSEL1_V = ioremap(GPFSEL1, sizeof(u32));
-	GPSET0_V = ioremap(GPSET0, sizeof(u32));
-	GPCLR0_V = ioremap(GPCLR0, sizeof(u32));
-
-	GPFSEL_read = ioread32(GPFSEL1_V); /* Read current value */
-	/* Set to 0 3 bits of each FSEL and keep equal the rest of bits,
-	 * then set to 1 the first bit of each FSEL (function) to set 3 GPIOS to output.
-	 */
-	GPFSEL_write = (GPFSEL_read & ~GPIO_MASK_18_BUZZER)
-			| (GPIO_SET_FUNCTION_18_BUZZER & GPIO_MASK_18_BUZZER);
-	iowrite32(GPFSEL_write, GPFSEL1_V); /* Set buzzer to output */
-
-	iowrite32(GPIO_18_INDEX, GPCLR0_V); /* Clear GPIO 18, output is low */
-
 	/* Allocate dynamically device numbers */
 	ret_val = alloc_chrdev_region(&dev_no, 0, 1, DEVICE_NAME);
 	if (ret_val < 0) {
 		pr_info("[+] Unable to allocate major number\n");
 
-		return ret_val;
+		goto err_driver;
 	}
 
 	/* Get the device identifiers */
@@ -183,55 +790,82 @@ static int buzzer_init(void)
 	/* Register the device class */
 	buzzer_class = class_create(THIS_MODULE, CLASS_NAME);
 	if (IS_ERR(buzzer_class)) {
-		unregister_chrdev_region(dev, 1);
-
 		pr_info("[+] Failed to register device class\n");
+		ret_val = PTR_ERR(buzzer_class);
 
-		return PTR_ERR(buzzer_class);
+		goto err_region;
 	}
 	pr_info("[+] Device class registered correclty\n");
 
 	/* Create a device node named DEVICE_NAME associated to dev */
 	buzzer_dev = device_create(buzzer_class, NULL, dev, NULL, DEVICE_NAME);
 	if (IS_ERR(buzzer_dev)) {
-		class_destroy(buzzer_class);
-		unregister_chrdev_region(dev, 1);
-
 		pr_info("[+] Failed to create the device\n");
+		ret_val = PTR_ERR(buzzer_dev);
 
-		return PTR_ERR(buzzer_dev);
+		goto err_class;
 	}
 	pr_info("[+] The device is created correctly\n");
 
-	ret_val = device_create_file(buzzer_dev, &dev_attr_temperature);
-	if (ret_val != 0) {
-		dev_err(buzzer_dev, "[+] Failed to create sysfs entry");
+	for (i = 0; i < ARRAY_SIZE(buzzer_attrs); ++i) {
+		ret_val = device_create_file(buzzer_dev, buzzer_attrs[i]);
+		if (ret_val != 0) {
+			dev_err(buzzer_dev, "[+] Failed to create sysfs entry");
 
-		return ret_val;
+			goto err_files;
+		}
 	}
 
+	buzzer_debugfs = debugfs_create_dir("buzzer_tone", NULL);
+	debugfs_create_file("stats", S_IRUSR | S_IWUSR, buzzer_debugfs, NULL, &buzzer_stats_fops);
+
+	/* Without a "dht11" phandle the frames are ignored */
+	dht11_register_notifier(&buzzer_dht11_notifier);
+
 	pr_info("[+] buzzer_init exit\n");
 
 	return 0;
+
+	/* In reverse, buzzer_remove() stops the timers before the ring goes */
+err_files:
+	while (i--) {
+		device_remove_file(buzzer_dev, buzzer_attrs[i]);
+	}
+	device_destroy(buzzer_class, dev);
+err_class:
+	class_destroy(buzzer_class);
+err_region:
+	unregister_chrdev_region(dev, 1);
+err_driver:
+	platform_driver_unregister(&buzzer_platform_driver);
+err_ring:
+	vfree(buzzer_ring);
+
+	return ret_val;
 }
 
 static void buzzer_exit(void)
 {
+	size_t i;
+
 	pr_info("[+] buzzer_exit enter\n");
 
-	device_remove_file(buzzer_dev, &dev_attr_temperature);
+	dht11_unregister_notifier(&buzzer_dht11_notifier);
+
+	for (i = 0; i < ARRAY_SIZE(buzzer_attrs); ++i) {
+		device_remove_file(buzzer_dev, buzzer_attrs[i]);
+	}
+	buzzer_tone_stop();
+
+	debugfs_remove_recursive(buzzer_debugfs);
 
 	device_destroy(buzzer_class, dev); /* Remove the device */
 	class_destroy(buzzer_class); /* Remove the device class */
 	unregister_chrdev_region(dev, 1); /* Unregister the device numbers */
 
-	iowrite32(GPIO_18_INDEX, GPCLR0_V); /* Clear buzzer */
-
-	iounmap(GPFSEL1_V);
-	iounmap(GPSET0_V);
-	iounmap(GPCLR0_V);
+	platform_driver_unregister(&buzzer_platform_driver); /* buzzer_remove() clears the buzzer */
 
-	platform_driver_unregister(&buzzer_platform_driver);
+	vfree(buzzer_ring);
 
 	pr_info("[+] buzzer_exit exit\n");
 }
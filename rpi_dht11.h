@@ -0,0 +1,71 @@
+/*
+ * In-kernel consumers of DHT11 frames
+ *
+ * rpi_dht11_driver.c calls a blocking notifier chain with a struct
+ * dht11_frame for every frame it decodes, from its workqueue. The LEDs,
+ * buzzer and LCD1602 drivers subscribe to it, so they follow the sensor
+ * without app.c relaying every sample through sysfs. Each sink follows the
+ * sensor that the "dht11" phandle of its DT node points to. A sink without one
+ * ignores the frames, so several sensors never take turns on one sink. The
+ * sinks call dht11_register_notifier() directly, so their modules depend on
+ * the DHT11 one and never miss the chain because of load order.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RPI_DHT11_H
+#define RPI_DHT11_H
+
+#include <linux/types.h>
+#include <linux/notifier.h>
+#include <linux/device.h>
+#include <linux/of.h>
+
+#define DHT11_EVENT_FRAME 0 /* data is a const struct dht11_frame * */
+
+struct dht11_frame {
+	struct device *dev; /* The sensor it came from */
+	int temperature;
+	int humidity;
+	s64 timestamp; /* CLOCK_BOOTTIME ns */
+};
+
+int dht11_register_notifier(struct notifier_block *nb);
+int dht11_unregister_notifier(struct notifier_block *nb);
+
+static inline void dht11_sensor_put(void *sensor)
+{
+	of_node_put(sensor);
+}
+
+/* dht11_sensor_get: The sensor the "dht11" phandle of dev points to, held until
+ * dev is unbound. NULL if there is none, the sink then only follows sysfs.
+ */
+static inline struct device_node *dht11_sensor_get(struct device *dev)
+{
+	struct device_node *sensor;
+	int ret;
+
+	sensor = of_parse_phandle(dev->of_node, "dht11", 0);
+	if (!sensor) {
+		return NULL;
+	}
+
+	ret = devm_add_action_or_reset(dev, dht11_sensor_put, sensor);
+	if (ret) {
+		return ERR_PTR(ret);
+	}
+
+	return sensor;
+}
+
+/* dht11_frame_from: frame was decoded by sensor, never true without one */
+static inline bool dht11_frame_from(const struct dht11_frame *frame, const struct device_node *sensor)
+{
+	return sensor && frame->dev->of_node == sensor;
+}
+
+#endif /* RPI_DHT11_H */
@@ -0,0 +1,317 @@
+/*
+ * DHT11 frame decoder
+ *
+ * Shared between rpi_dht11_driver.c and the userspace tools, so that they
+ * decode captured edges with exactly the same code.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RPI_DHT11_DECODE_H
+#define RPI_DHT11_DECODE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#else
+#include <stdint.h>
+#include <errno.h>
+
+typedef uint8_t u8;
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef uint64_t u64;
+#endif
+
+#define DHT11_EDGES_PREAMBLE 2
+#define DHT11_BITS_PER_READ 40
+
+/* Note that when reading the sensor actually 84 edges are detected, but
+ * since the last edge is not significant, we only store 83:
+ */
+#define DHT11_EDGES_PER_READ (2 * DHT11_BITS_PER_READ + DHT11_EDGES_PREAMBLE + 1)
+
+#define DHT11_THRESHOLD_IN_DECODE_FUNC 49000 /* ns */
+
+/* Edges as captured: delta[i] is the time from edge i - 1 to edge i in ns
+ * (delta[0] is always 0) and bit i of levels is the line level after edge i.
+ * 352 bytes instead of 16 bytes per edge for a {s64 ts; int value} array.
+ */
+struct dht11_edges {
+	u32 delta[DHT11_EDGES_PER_READ];
+	u32 reserved; /* Keeps levels 8-byte aligned on every ABI */
+	u64 levels[2];
+};
+
+/* Every bit starts with a rising edge: the levels of edges offset + 1,
+ * offset + 3, ... offset + 79 have to be high.
+ */
+#define DHT11_SYNC_MASK_LO 0x5555555555555555ULL
+#define DHT11_SYNC_MASK_HI 0x5555ULL
+
+/* Frame layout, MSB first: hum_int hum_dec temp_int temp_dec checksum */
+#define DHT11_FRAME_BYTE(frame, n) ((u8)((frame) >> (8 * (4 - (n)))))
+#define DHT11_FRAME_HUM_INT(frame) DHT11_FRAME_BYTE(frame, 0)
+#define DHT11_FRAME_HUM_DEC(frame) DHT11_FRAME_BYTE(frame, 1)
+#define DHT11_FRAME_TEMP_INT(frame) DHT11_FRAME_BYTE(frame, 2)
+#define DHT11_FRAME_TEMP_DEC(frame) DHT11_FRAME_BYTE(frame, 3)
+#define DHT11_FRAME_CHECKSUM(frame) DHT11_FRAME_BYTE(frame, 4)
+
+static inline int dht11_edge_level(const struct dht11_edges *edges, int i)
+{
+	return (edges->levels[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void dht11_edge_set_level(struct dht11_edges *edges, int i, int value)
+{
+	if (value) {
+		edges->levels[i / 64] |= 1ULL << (i % 64);
+	} else {
+		edges->levels[i / 64] &= ~(1ULL << (i % 64));
+	}
+}
+
+/* dht11_edges_in_sync: Check all 40 rising edges at once, offset + 1 < 64 */
+static inline int dht11_edges_in_sync(const struct dht11_edges *edges, int offset)
+{
+	int shift = offset + 1;
+	u64 lo, hi;
+
+	lo = (edges->levels[0] >> shift) | (edges->levels[1] << (64 - shift));
+	hi = edges->levels[1] >> shift;
+
+	return (lo & DHT11_SYNC_MASK_LO) == DHT11_SYNC_MASK_LO && (hi & DHT11_SYNC_MASK_HI) == DHT11_SYNC_MASK_HI;
+}
+
+static inline int dht11_frame_checksum_ok(u64 frame)
+{
+	return ((DHT11_FRAME_HUM_INT(frame) + DHT11_FRAME_HUM_DEC(frame) + DHT11_FRAME_TEMP_INT(frame) + DHT11_FRAME_TEMP_DEC(frame)) & 0xff) == DHT11_FRAME_CHECKSUM(frame);
+}
+
+/* dht11_decode_bits: Decode the 40 bits starting at edge offset + 1 into one word.
+ * Every bit is the high time between edge offset + 2i + 1 and offset + 2i + 2,
+ * so the comparisons against threshold (ns) are shifted straight into the result.
+ */
+static inline int dht11_decode_bits(const struct dht11_edges *edges, int offset, u32 threshold, u64 *bits)
+{
+	const u32 *delta = &edges->delta[offset + 2];
+	u64 word = 0;
+	int i;
+
+	if (!dht11_edges_in_sync(edges, offset)) {
+		return -EIO; /* Lost synchronisation */
+	}
+
+	for (i = 0; i < DHT11_BITS_PER_READ; ++i) {
+		word = (word << 1) | (delta[2 * i] > threshold);
+	}
+
+	*bits = word;
+
+	return 0;
+}
+
+/* dht11_decode_frame: Returns -EIO on lost synchronisation and -EBADMSG on a
+ * checksum mismatch.
+ */
+static inline int dht11_decode_frame(const struct dht11_edges *edges, int offset, u32 threshold, u64 *frame)
+{
+	u64 bits;
+	int ret;
+
+	ret = dht11_decode_bits(edges, offset, threshold, &bits);
+	if (ret) {
+		return ret;
+	}
+
+	if (!dht11_frame_checksum_ok(bits)) {
+		return -EBADMSG;
+	}
+
+	*frame = bits;
+
+	return 0;
+}
+
+/* Checksum-guided recovery: only bits whose pulse ended within
+ * DHT11_RECOVER_MARGIN of the threshold are doubted, at most
+ * DHT11_RECOVER_BITS of them, and at most two are flipped at once. Every
+ * guess is a 1 in 256 chance of accepting garbage, ~4% over the 10 guesses,
+ * so a guess must also be a plausible DHT11 reading close to the last frame
+ * that passed the checksum as it was.
+ */
+#define DHT11_RECOVER_BITS 4
+#define DHT11_RECOVER_MARGIN 12000 /* ns */
+#define DHT11_RECOVER_HUM_MIN 20 /* %, the DHT11 range */
+#define DHT11_RECOVER_HUM_MAX 90
+#define DHT11_RECOVER_TEMP_MIN 0 /* C */
+#define DHT11_RECOVER_TEMP_MAX 50
+#define DHT11_RECOVER_HUM_DELTA 10 /* From the good frame */
+#define DHT11_RECOVER_TEMP_DELTA 5
+
+/* dht11_frame_plausible: A repaired frame, against good, a frame decoded without repair */
+static inline int dht11_frame_plausible(u64 frame, u64 good)
+{
+	int hum = DHT11_FRAME_HUM_INT(frame), temp = DHT11_FRAME_TEMP_INT(frame);
+	int hum_delta = hum - DHT11_FRAME_HUM_INT(good), temp_delta = temp - DHT11_FRAME_TEMP_INT(good);
+
+	if (DHT11_FRAME_HUM_DEC(frame) || DHT11_FRAME_TEMP_DEC(frame)) {
+		return 0; /* Always 0 on a DHT11 */
+	}
+
+	if (hum < DHT11_RECOVER_HUM_MIN || hum > DHT11_RECOVER_HUM_MAX || temp < DHT11_RECOVER_TEMP_MIN || temp > DHT11_RECOVER_TEMP_MAX) {
+		return 0;
+	}
+
+	return hum_delta >= -DHT11_RECOVER_HUM_DELTA && hum_delta <= DHT11_RECOVER_HUM_DELTA
+		&& temp_delta >= -DHT11_RECOVER_TEMP_DELTA && temp_delta <= DHT11_RECOVER_TEMP_DELTA;
+}
+
+/* dht11_decode_frame_recover: dht11_decode_frame(), then on a checksum mismatch
+ * flip the least confident bits until the checksum matches on a plausible
+ * frame. good is the last frame decoded without repair, 0 for none, which
+ * turns the repair off. *flipped is the number of bits changed.
+ */
+static inline int dht11_decode_frame_recover(const struct dht11_edges *edges, int offset, u32 threshold, u64 good, u64 *frame, int *flipped)
+{
+	const u32 *delta = &edges->delta[offset + 2];
+	u32 margin[DHT11_RECOVER_BITS], m;
+	int bit[DHT11_RECOVER_BITS];
+	int i, j, n = 0, ret;
+	u64 bits, mask;
+
+	*flipped = 0;
+
+	ret = dht11_decode_bits(edges, offset, threshold, &bits);
+	if (ret) {
+		return ret;
+	}
+
+	if (dht11_frame_checksum_ok(bits)) {
+		*frame = bits;
+
+		return 0;
+	}
+
+	if (!good) {
+		return -EBADMSG;
+	}
+
+	/* Keep the candidates sorted by margin, least confident first */
+	for (i = 0; i < DHT11_BITS_PER_READ; ++i) {
+		m = delta[2 * i] > threshold ? delta[2 * i] - threshold : threshold - delta[2 * i];
+		if (m >= DHT11_RECOVER_MARGIN || (n == DHT11_RECOVER_BITS && m >= margin[n - 1])) {
+			continue;
+		}
+
+		j = n < DHT11_RECOVER_BITS ? n++ : n - 1;
+		for (; j > 0 && margin[j - 1] > m; --j) {
+			margin[j] = margin[j - 1];
+			bit[j] = bit[j - 1];
+		}
+		margin[j] = m;
+		bit[j] = DHT11_BITS_PER_READ - 1 - i;
+	}
+
+	for (i = 0; i < n; ++i) {
+		mask = 1ULL << bit[i];
+		if (dht11_frame_checksum_ok(bits ^ mask) && dht11_frame_plausible(bits ^ mask, good)) {
+			*frame = bits ^ mask;
+			*flipped = 1;
+
+			return 0;
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		for (j = i + 1; j < n; ++j) {
+			mask = (1ULL << bit[i]) | (1ULL << bit[j]);
+			if (dht11_frame_checksum_ok(bits ^ mask) && dht11_frame_plausible(bits ^ mask, good)) {
+				*frame = bits ^ mask;
+				*flipped = 2;
+
+				return 0;
+			}
+		}
+	}
+
+	return -EBADMSG;
+}
+
+/* Adaptive threshold: the 0-bit and 1-bit pulse lengths form two clusters
+ * whose position depends on the cable and the clock. The longest 0-bit and
+ * the shortest 1-bit of every good frame are tracked as moving averages and
+ * the threshold is placed in the middle of the gap between them.
+ */
+#define DHT11_MODEL_ZERO_MAX 30000 /* ns, initial longest 0-bit */
+#define DHT11_MODEL_ONE_MIN 68000 /* ns, initial shortest 1-bit */
+#define DHT11_MODEL_SHIFT 3 /* Every frame moves the averages by 1/8 */
+
+struct dht11_threshold_model {
+	u32 zero_max; /* ns */
+	u32 one_min; /* ns */
+};
+
+static inline void dht11_threshold_init(struct dht11_threshold_model *model)
+{
+	model->zero_max = DHT11_MODEL_ZERO_MAX;
+	model->one_min = DHT11_MODEL_ONE_MIN;
+}
+
+static inline u32 dht11_threshold(const struct dht11_threshold_model *model)
+{
+	if (model->zero_max >= model->one_min) {
+		return DHT11_THRESHOLD_IN_DECODE_FUNC; /* No gap (yet), don't guess */
+	}
+
+	return model->zero_max + (model->one_min - model->zero_max) / 2;
+}
+
+/* dht11_threshold_learn: Feed the pulses of a frame that passed the checksum
+ * unrepaired, a repaired one would teach it the pulses that fooled it
+ */
+static inline void dht11_threshold_learn(struct dht11_threshold_model *model, const struct dht11_edges *edges, int offset, u64 frame)
+{
+	const u32 *delta = &edges->delta[offset + 2];
+	u32 zero_max = 0, one_min = 0xffffffff;
+	int i;
+
+	for (i = 0; i < DHT11_BITS_PER_READ; ++i) {
+		if ((frame >> (DHT11_BITS_PER_READ - 1 - i)) & 1) {
+			one_min = delta[2 * i] < one_min ? delta[2 * i] : one_min;
+		} else {
+			zero_max = delta[2 * i] > zero_max ? delta[2 * i] : zero_max;
+		}
+	}
+
+	if (zero_max) {
+		model->zero_max = (s32)model->zero_max + (((s32)zero_max - (s32)model->zero_max) >> DHT11_MODEL_SHIFT);
+	}
+	if (one_min != 0xffffffff) {
+		model->one_min = (s32)model->one_min + (((s32)one_min - (s32)model->one_min) >> DHT11_MODEL_SHIFT);
+	}
+}
+
+/* Trace of one transaction as exported through debugfs, oldest record first.
+ * result is 0, -ETIMEDOUT or the status of the last offset tried, offset is
+ * the one that decoded (-1 if none) and frame is only valid if result is 0.
+ */
+#define DHT11_TRACE_RECORDS 16
+
+struct dht11_trace {
+	s64 timestamp; /* CLOCK_BOOTTIME ns at the end of the transaction */
+	u32 seq;
+	s32 num_edges;
+	s32 result;
+	s32 offset;
+	u32 threshold; /* ns */
+	u32 reserved;
+	u64 frame;
+	struct dht11_edges edges;
+};
+
+#endif /* RPI_DHT11_DECODE_H */
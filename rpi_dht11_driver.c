@@ -30,294 +30,1504 @@
 #include <linux/bitops.h>
 #include <linux/completion.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include <linux/delay.h>
 #include <linux/gpio.h>
 #include <linux/of_gpio.h>
 #include <linux/timekeeping.h>
+#include <linux/hrtimer.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/spinlock.h>
+#include <linux/fs.h>
+#include <linux/irqflags.h>
+#include <linux/timex.h>
+#include <linux/math64.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
 
 #include <linux/iio/iio.h>
+#include <linux/iio/sysfs.h>
+#include <linux/iio/events.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+
+#include "rpi_dht11_decode.h"
+#include "rpi_dht11.h"
+
+#define CREATE_TRACE_POINTS
+#define RPI_TRACE_DHT11
+#include "rpi_trace.h"
 
 #define DRIVER_NAME "my_dht11"
 
 #define DHT11_DATA_VALID_TIME 2000000000 /* 2s in ns */
+#define DHT11_MAX_SAMPLING_FREQ 500000 /* uHz, one frame per DHT11_DATA_VALID_TIME */
+
+/* Data transmission timing:
+ * Data bits are encoded as pulse length (high time) on the data line.
+ * 0-bit: 22-30uS -- typically 26uS (AM2302)
+ * 1-bit: 68-75uS -- typically 70uS (AM2302)
+ * The acutal timings also depend on the properties of the cable, with
+ * longer cables typically making pulses shorter.
+ *
+ * Our decoding depends on the time resolution of the system:
+ * timeres > 34uS ... don't know what a 1-tick pulse is
+ * 34uS > timeres > 30uS ... no problem (30kHz and 32kHz clocks)
+ * 30uS > timeres > 23uS ... don't know what a 2-tick pulse is
+ * timeres < 23uS ... no problem
+ *
+ * Luckily clocks in the 33-44kHz range are quite uncommon, so we can
+ * support most systems if the threshold for decoding a pulse as 1-bit
+ * is chosen carefully. If somebody really wants to support clocks around
+ * 40kHz, where this driver is most unreliable, there are two options.
+ * a) select an implementation using busy loop polling on those systems
+ * b) use the checksum to do some probabilistic decoding
+ * a) is what acquisition_mode "poll" does, see dht11_poll_edges().
+ * b) is what threshold_mode "adaptive" does, see rpi_dht11_decode.h.
+ */
+#define DHT11_START_TRANSMISSION_MIN 18000 /* us */
+#define DHT11_START_TRANSMISSION_MAX 20000 /* us */
+#define DHT11_MIN_TIMERES 34000 /* ns */
+#define DHT11_THRESHOLD_IN_IRQ 15000 /* ns */
+#define DHT11_AMBIG_LOW 23000 /* ns */
+#define DHT11_AMBIG_HIGH 30000 /* ns */
+#define DHT11_FRAME_TIMEOUT NSEC_PER_SEC /* ns */
+#define DHT11_POLL_TIMEOUT 10000000 /* ns, response plus 40 bits of at most 130us each */
+#define DHT11_POLL_CALIBRATION 100 /* ms, the cycle counter rate is measured over */
+
+/* Transaction state machine:
+ * IDLE -> QUEUED (waiting for the frame of another sensor to end)
+ *      -> START (line held low, hrtimer armed for the start pulse)
+ *      -> CAPTURE (line released from process context, IRQ collects edges,
+ *                  hrtimer armed as frame timeout)
+ *      -> DECODE (all edges seen or timeout, decode runs from the workqueue)
+ *      -> IDLE
+ * Nothing sleeps on the bus: callers that want the result wait on completion.
+ */
+enum dht11_state {
+	DHT11_IDLE,
+	DHT11_QUEUED,
+	DHT11_START,
+	DHT11_CAPTURE,
+	DHT11_DECODE,
+};
+
+#define DHT11_FLAG_PUSH 0 /* Push the frame to the buffer once it is decoded */
+
+/* Temperature threshold events, in degrees like the channel itself */
+enum dht11_event {
+	DHT11_EV_RISING,
+	DHT11_EV_FALLING,
+	DHT11_EV_NUM,
+};
+
+#define DHT11_EV_RISING_DEFAULT 30
+#define DHT11_EV_FALLING_DEFAULT 25
+
+struct dht11_sample {
+	s64 timestamp;
+	int temperature;
+	int humidity;
+	unsigned int frame; /* frame: Decoded frames so far, 0 means "no sample yet" */
+};
+
+#define DHT11_HIST_BUCKETS 32 /* log2 buckets, bucket i counts values in [2^(i-1), 2^i) */
+
+/* Per-device counters for the debugfs "stats" file. A read is a cache hit
+ * when it is served from a frame younger than DHT11_DATA_VALID_TIME (or from
+ * the snapshot while sampling in the background), and fresh if it waited for
+ * a transaction.
+ */
+struct dht11_stats {
+	u64 transactions;
+	u64 decoded;
+	u64 recovered; /* Of decoded, repaired by bit flipping */
+	u64 checksum;
+	u64 sync;
+	u64 timeouts;
+	u64 errors; /* Failed to drive the line */
+	u64 cache_hits;
+	u64 fresh_reads;
+	u32 latency[DHT11_HIST_BUCKETS]; /* us from dht11_start() to dht11_finish() */
+	u32 first_edge[DHT11_HIST_BUCKETS]; /* ns from release to the first edge */
+	u32 edges[DHT11_EDGES_PER_READ + 1]; /* Edges captured */
+	u32 offset[DHT11_EDGES_PREAMBLE + 1]; /* Offset that decoded */
+};
+
+struct dht11 {
+	struct device *dev;
+	struct iio_dev *iio_dev;
+
+	int gpio;
+	int irq;
+
+	struct completion completion; /* Completed on every return to DHT11_IDLE */
+	struct mutex lock; /* The iio sysfs interface doesn't prevent concurrent reads: */
+
+	int state; /* enum dht11_state */
+	int result; /* Status of the last transaction, valid in DHT11_IDLE */
+	unsigned long flags;
+	struct hrtimer timer;
+	struct work_struct work;
+
+	/* Published under sample_lock so that readers never wait on the bus: */
+	seqlock_t sample_lock;
+	struct dht11_sample sample;
+
+	int event_value[DHT11_EV_NUM];
+	bool event_enabled[DHT11_EV_NUM];
+
+	unsigned int sampling_period; /* ms, 0 means "acquire on demand" */
+	struct delayed_work sampling_work;
+
+	struct list_head node; /* In dht11_devices */
+	unsigned int index; /* Position in dht11_devices, sets the sampling phase */
+	struct list_head bus_node; /* In dht11_bus_waiters while DHT11_QUEUED */
+
+	s64 start_ts; /* dht11_start() of this transaction */
+	s64 release_ts; /* End of the start pulse */
+	s64 first_edge_latency; /* ns from release_ts to the first captured edge, -1 if none */
+
+	u32 threshold; /* ns, high pulses longer than this decode as 1-bits */
+	bool adaptive; /* Learn threshold from good frames and repair bad checksums */
+	bool polling; /* Sample the line with interrupts off instead of using the IRQ */
+	u32 poll_stamps[DHT11_EDGES_PER_READ]; /* Cycle counter at each polled edge */
+	u32 poll_rate; /* Cycle counter ticks per ms, measured when polling was chosen */
+	struct dht11_threshold_model model;
+	u64 good_frame; /* Last frame decoded without repair, 0 for none */
+
+	int num_edges; /* num_edges: -1 means "no transmission in progress" */
+	s64 last_ts; /* Timestamp of edge num_edges - 1 */
+	struct dht11_edges edges;
+
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *debugfs;
+	spinlock_t trace_lock;
+	u32 trace_seq;
+	struct dht11_trace *traces; /* Ring of the last DHT11_TRACE_RECORDS transactions */
+	spinlock_t stats_lock;
+	struct dht11_stats stats;
+#endif
+};
+
+/* All bound sensors. Their frames are staggered over the sampling period and
+ * never overlap: one sensor owns the bus from its start pulse to the end of
+ * its frame, the others wait in DHT11_QUEUED and are started in turn.
+ */
+static LIST_HEAD(dht11_devices);
+static DEFINE_MUTEX(dht11_devices_lock);
+static unsigned int dht11_num_devices;
+static unsigned long dht11_epoch; /* jiffies, sampling phases are relative to it */
+
+/* In-kernel sinks, called with every decoded frame, see rpi_dht11.h */
+static BLOCKING_NOTIFIER_HEAD(dht11_notifier);
+
+int dht11_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&dht11_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(dht11_register_notifier);
+
+int dht11_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&dht11_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(dht11_unregister_notifier);
+
+static DEFINE_SPINLOCK(dht11_bus_lock);
+static struct dht11 *dht11_bus_owner;
+static LIST_HEAD(dht11_bus_waiters);
+
+#ifdef CONFIG_DYNAMIC_DEBUG
+/* dht11_edges_print: Show the data as actually received by the driver. */
+static void dht11_edges_print(struct dht11 *dht11)
+{
+	int i;
+
+	dev_dbg(dht11->dev, "[+] %d edges detected:\n", dht11->num_edges);
+
+	for (i = 1; i < dht11->num_edges; ++i) {
+		dev_dbg(dht11->dev, "[+] %d: %u ns %s\n", i, dht11->edges.delta[i], dht11_edge_level(&dht11->edges, i - 1) ? "high" : "low");
+	}
+}
+#endif /* CONFIG_DYNAMIC_DEBUG */
+
+#ifdef CONFIG_DEBUG_FS
+/* dht11_trace: Keep the edges of this transaction for the debugfs "traces" file */
+static void dht11_trace(struct dht11 *dht11, int result, int offset, u32 threshold, u64 frame)
+{
+	struct dht11_trace *trace;
+
+	spin_lock(&dht11->trace_lock);
+
+	trace = &dht11->traces[dht11->trace_seq % DHT11_TRACE_RECORDS];
+	trace->timestamp = ktime_get_boot_ns();
+	trace->seq = dht11->trace_seq++;
+	trace->num_edges = dht11->num_edges;
+	trace->result = result;
+	trace->offset = offset;
+	trace->threshold = threshold;
+	trace->frame = result ? 0 : frame;
+	trace->edges = dht11->edges;
+
+	spin_unlock(&dht11->trace_lock);
+}
+
+struct dht11_traces_snapshot {
+	size_t size;
+	struct dht11_trace traces[DHT11_TRACE_RECORDS];
+};
+
+/* The ring is copied on open, so one reader sees a consistent set of records */
+static int dht11_traces_open(struct inode *inode, struct file *file)
+{
+	struct dht11 *dht11 = inode->i_private;
+	struct dht11_traces_snapshot *snapshot;
+	u32 seq, count, i;
+
+	snapshot = kmalloc(sizeof(*snapshot), GFP_KERNEL);
+	if (!snapshot) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&dht11->trace_lock);
+
+	count = min_t(u32, dht11->trace_seq, DHT11_TRACE_RECORDS);
+	seq = dht11->trace_seq - count;
+	for (i = 0; i < count; ++i) {
+		snapshot->traces[i] = dht11->traces[(seq + i) % DHT11_TRACE_RECORDS];
+	}
+
+	spin_unlock(&dht11->trace_lock);
+
+	snapshot->size = count * sizeof(struct dht11_trace);
+	file->private_data = snapshot;
+
+	return 0;
+}
+
+static ssize_t dht11_traces_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct dht11_traces_snapshot *snapshot = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snapshot->traces, snapshot->size);
+}
+
+static int dht11_traces_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
+	return 0;
+}
+
+static const struct file_operations dht11_traces_fops = {
+	.owner = THIS_MODULE,
+	.open = dht11_traces_open,
+	.read = dht11_traces_read,
+	.release = dht11_traces_release,
+	.llseek = default_llseek,
+};
+
+static void dht11_hist_add(u32 *hist, u64 value)
+{
+	++hist[min_t(int, fls64(value), DHT11_HIST_BUCKETS - 1)];
+}
+
+/* dht11_stats_frame: Account a transaction that got as far as decoding.
+ * result is the status of the last offset tried, as for dht11_trace().
+ */
+static void dht11_stats_frame(struct dht11 *dht11, int result, int offset)
+{
+	struct dht11_stats *stats = &dht11->stats;
+
+	spin_lock(&dht11->stats_lock);
+
+	if (dht11->first_edge_latency >= 0) {
+		dht11_hist_add(stats->first_edge, dht11->first_edge_latency);
+	}
+	++stats->edges[clamp(dht11->num_edges, 0, DHT11_EDGES_PER_READ)];
+
+	if (result == 0) {
+		++stats->decoded;
+		++stats->offset[offset];
+	} else if (result == -EBADMSG) {
+		++stats->checksum;
+	} else if (result == -EIO) {
+		++stats->sync;
+	} else if (result == -ETIMEDOUT) {
+		++stats->timeouts;
+	}
+
+	spin_unlock(&dht11->stats_lock);
+}
+
+/* dht11_stats_finish: Account every transaction, including those that failed to start */
+static void dht11_stats_finish(struct dht11 *dht11, int ret)
+{
+	struct dht11_stats *stats = &dht11->stats;
+	s64 latency = ktime_get_boot_ns() - dht11->start_ts;
+
+	spin_lock(&dht11->stats_lock);
+
+	++stats->transactions;
+	if (ret && ret != -EIO && ret != -ETIMEDOUT) {
+		++stats->errors;
+	}
+	dht11_hist_add(stats->latency, div_u64(latency, NSEC_PER_USEC));
+
+	spin_unlock(&dht11->stats_lock);
+}
+
+static void dht11_stats_recovered(struct dht11 *dht11)
+{
+	spin_lock(&dht11->stats_lock);
+	++dht11->stats.recovered;
+	spin_unlock(&dht11->stats_lock);
+}
+
+static void dht11_stats_read(struct dht11 *dht11, bool cache_hit)
+{
+	spin_lock(&dht11->stats_lock);
+	if (cache_hit) {
+		++dht11->stats.cache_hits;
+	} else {
+		++dht11->stats.fresh_reads;
+	}
+	spin_unlock(&dht11->stats_lock);
+}
+
+static void dht11_hist_show(struct seq_file *s, const char *name, const u32 *hist, int buckets)
+{
+	int i;
+
+	seq_printf(s, "%s:\n", name);
+	for (i = 0; i < buckets; ++i) {
+		if (hist[i]) {
+			seq_printf(s, "\t< %llu: %u\n", 1ULL << i, hist[i]);
+		}
+	}
+}
+
+static int dht11_stats_show(struct seq_file *s, void *unused)
+{
+	struct dht11 *dht11 = s->private;
+	struct dht11_stats *stats;
+	int i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats) {
+		return -ENOMEM;
+	}
+
+	spin_lock(&dht11->stats_lock);
+	*stats = dht11->stats;
+	spin_unlock(&dht11->stats_lock);
+
+	seq_printf(s, "transactions %llu\n", stats->transactions);
+	seq_printf(s, "decoded %llu\n", stats->decoded);
+	seq_printf(s, "recovered %llu\n", stats->recovered);
+	seq_printf(s, "checksum %llu\n", stats->checksum);
+	seq_printf(s, "sync %llu\n", stats->sync);
+	seq_printf(s, "timeouts %llu\n", stats->timeouts);
+	seq_printf(s, "errors %llu\n", stats->errors);
+	seq_printf(s, "cache_hits %llu\n", stats->cache_hits);
+	seq_printf(s, "fresh_reads %llu\n", stats->fresh_reads);
+
+	dht11_hist_show(s, "latency_us", stats->latency, DHT11_HIST_BUCKETS);
+	dht11_hist_show(s, "first_edge_ns", stats->first_edge, DHT11_HIST_BUCKETS);
+
+	seq_puts(s, "edges:\n");
+	for (i = 0; i <= DHT11_EDGES_PER_READ; ++i) {
+		if (stats->edges[i]) {
+			seq_printf(s, "\t%d: %u\n", i, stats->edges[i]);
+		}
+	}
+
+	seq_puts(s, "offset:\n");
+	for (i = 0; i <= DHT11_EDGES_PREAMBLE; ++i) {
+		seq_printf(s, "\t%d: %u\n", i, stats->offset[i]);
+	}
+
+	kfree(stats);
+
+	return 0;
+}
+
+static int dht11_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dht11_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t dht11_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct dht11 *dht11 = ((struct seq_file *)file->private_data)->private;
+
+	spin_lock(&dht11->stats_lock);
+	memset(&dht11->stats, 0, sizeof(dht11->stats));
+	spin_unlock(&dht11->stats_lock);
+
+	return count;
+}
+
+static const struct file_operations dht11_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = dht11_stats_open,
+	.read = seq_read,
+	.write = dht11_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void dht11_debugfs_remove(void *data)
+{
+	struct dht11 *dht11 = data;
+
+	debugfs_remove_recursive(dht11->debugfs);
+}
+
+static int dht11_debugfs_init(struct dht11 *dht11)
+{
+	dht11->traces = devm_kcalloc(dht11->dev, DHT11_TRACE_RECORDS, sizeof(struct dht11_trace), GFP_KERNEL);
+	if (!dht11->traces) {
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&dht11->trace_lock);
+	spin_lock_init(&dht11->stats_lock);
+
+	/* debugfs is best effort, a missing directory only costs the traces and stats */
+	dht11->debugfs = debugfs_create_dir(dev_name(dht11->dev), NULL);
+	debugfs_create_file("traces", S_IRUSR, dht11->debugfs, dht11, &dht11_traces_fops);
+	debugfs_create_file("stats", S_IRUSR | S_IWUSR, dht11->debugfs, dht11, &dht11_stats_fops);
+
+	return devm_add_action(dht11->dev, dht11_debugfs_remove, dht11);
+}
+#else
+static inline void dht11_trace(struct dht11 *dht11, int result, int offset, u32 threshold, u64 frame)
+{
+}
+
+static inline void dht11_stats_frame(struct dht11 *dht11, int result, int offset)
+{
+}
+
+static inline void dht11_stats_finish(struct dht11 *dht11, int ret)
+{
+}
+
+static inline void dht11_stats_recovered(struct dht11 *dht11)
+{
+}
+
+static inline void dht11_stats_read(struct dht11 *dht11, bool cache_hit)
+{
+}
+
+static inline int dht11_debugfs_init(struct dht11 *dht11)
+{
+	return 0;
+}
+#endif /* CONFIG_DEBUG_FS */
+
+/* dht11_events: Push the threshold crossings between two consecutive frames.
+ * A rising event fires when the temperature reaches the value from below, a
+ * falling one when it drops to the value from above.
+ */
+static void dht11_events(struct dht11 *dht11, int prev, int temperature, s64 timestamp)
+{
+	int value;
+
+	value = READ_ONCE(dht11->event_value[DHT11_EV_RISING]);
+	if (READ_ONCE(dht11->event_enabled[DHT11_EV_RISING]) && prev < value && temperature >= value) {
+		iio_push_event(dht11->iio_dev, IIO_UNMOD_EVENT_CODE(IIO_TEMP, 0, IIO_EV_TYPE_THRESH, IIO_EV_DIR_RISING), timestamp);
+	}
+
+	value = READ_ONCE(dht11->event_value[DHT11_EV_FALLING]);
+	if (READ_ONCE(dht11->event_enabled[DHT11_EV_FALLING]) && prev > value && temperature <= value) {
+		iio_push_event(dht11->iio_dev, IIO_UNMOD_EVENT_CODE(IIO_TEMP, 0, IIO_EV_TYPE_THRESH, IIO_EV_DIR_FALLING), timestamp);
+	}
+}
+
+static int dht11_decode(struct dht11 *dht11, int offset, u32 threshold, u64 *frame)
+{
+	struct dht11_sample prev = dht11->sample;
+	unsigned char temp_int, hum_int;
+	int ret, flipped = 0;
+
+	if (READ_ONCE(dht11->adaptive)) {
+		ret = dht11_decode_frame_recover(&dht11->edges, offset, threshold, dht11->good_frame, frame, &flipped);
+	} else {
+		ret = dht11_decode_frame(&dht11->edges, offset, threshold, frame);
+	}
+	if (ret) {
+		dev_dbg(dht11->dev, "[+] %s at offset %d\n", ret == -EBADMSG ? "Invalid checksum" : "Lost synchronisation", offset);
+
+		return ret;
+	}
+
+	if (flipped) {
+		dev_dbg(dht11->dev, "[+] Recovered frame by flipping %d bits\n", flipped);
+		dht11_stats_recovered(dht11);
+	}
+
+	if (!flipped) {
+		dht11->good_frame = *frame;
+
+		if (READ_ONCE(dht11->adaptive)) {
+			dht11_threshold_learn(&dht11->model, &dht11->edges, offset, *frame);
+			WRITE_ONCE(dht11->threshold, dht11_threshold(&dht11->model));
+		}
+	}
+
+	temp_int = DHT11_FRAME_TEMP_INT(*frame);
+	hum_int = DHT11_FRAME_HUM_INT(*frame);
+
+	write_seqlock(&dht11->sample_lock);
+
+	dht11->sample.timestamp = ktime_get_boot_ns();
+
+//	if (hum_int < 20) {  /* DHT22 */
+//		dht11->sample.temperature = (((temp_int & 0x7f) << 8) + temp_dec) * ((temp_int & 0x80) ? -100 : 100);
+//		dht11->sample.humidity = ((hum_int << 8) + hum_dec) * 100;
+//	} else if (temp_dec == 0 && hum_dec == 0) {  /* DHT11 */
+//		dht11->sample.temperature = temp_int * 1000;
+//		dht11->sample.humidity = hum_int * 1000;
+//	} else {
+//		dev_err(dht11->dev, "[+] Don't know how to decode data: %d %d %d %d\n", hum_int, hum_dec, temp_int, temp_dec);
+//
+//		write_sequnlock(&dht11->sample_lock);
+//
+//		return -EIO;
+//	}
+
+	dht11->sample.temperature = temp_int;
+	dht11->sample.humidity = hum_int;
+	++dht11->sample.frame;
+
+	write_sequnlock(&dht11->sample_lock);
+
+	/* The first frame has nothing to cross from */
+	if (prev.frame) {
+		dht11_events(dht11, prev.temperature, dht11->sample.temperature, dht11->sample.timestamp);
+	}
+
+	return 0;
+}
+
+/* IRQ handler called on GPIO edges */
+static irqreturn_t dht11_handle_irq(int irq, void *data)
+{
+	struct iio_dev *iio = data;
+	struct dht11 *dht11 = iio_priv(iio);
+	int n, value;
+	s64 ts;
+
+	/* The IRQ stays requested between transactions, so it is armed by the state
+	 * machine instead. Anything seen while idle or queued belongs to whoever
+	 * shares the line. That includes the falling edge of our own start pulse,
+	 * since dht11_pulse() drives the line low before it sets DHT11_START. Only
+	 * the rising edge that ends the pulse comes in DHT11_START and is ours.
+	 */
+	switch (smp_load_acquire(&dht11->state)) {
+	case DHT11_CAPTURE:
+		break;
+	case DHT11_IDLE:
+	case DHT11_QUEUED:
+		return IRQ_NONE;
+	default:
+		return IRQ_HANDLED;
+	}
+
+	n = dht11->num_edges;
+	if (n < DHT11_EDGES_PER_READ && n >= 0) {
+		ts = ktime_get_boot_ns();
+
+		/* A glitch: drop it together with the edge it follows */
+		if (n >= 1 && ts - dht11->last_ts < DHT11_THRESHOLD_IN_IRQ) {
+			dht11->last_ts -= dht11->edges.delta[n - 1];
+			--dht11->num_edges;
+
+			return IRQ_HANDLED;
+		}
+
+		value = gpio_get_value(dht11->gpio);
+
+		/* The sensor answers with a falling edge, anything before is our own release */
+		if (n == 0) {
+			if (value) {
+				return IRQ_HANDLED;
+			}
+
+			dht11->first_edge_latency = ts - dht11->release_ts;
+		}
+
+		dht11->edges.delta[n] = n ? (u32)(ts - dht11->last_ts) : 0;
+		dht11_edge_set_level(&dht11->edges, n, value);
+		dht11->last_ts = ts;
+		dht11->num_edges = n + 1;
+
+		trace_dht11_edge(dht11->gpio, n, value, dht11->edges.delta[n]);
+
+		if (dht11->num_edges >= DHT11_EDGES_PER_READ && cmpxchg(&dht11->state, DHT11_CAPTURE, DHT11_DECODE) == DHT11_CAPTURE) {
+			queue_work(system_highpri_wq, &dht11->work);
+		}
+	}
+
+	return IRQ_HANDLED;
+}
+
+/* dht11_timer: End of the start pulse, or frame timeout while capturing */
+static enum hrtimer_restart dht11_timer(struct hrtimer *timer)
+{
+	struct dht11 *dht11 = container_of(timer, struct dht11, timer);
+
+	/* Releasing the line may sleep in pinctrl, so it is done from the workqueue too */
+	if (READ_ONCE(dht11->state) == DHT11_START || cmpxchg(&dht11->state, DHT11_CAPTURE, DHT11_DECODE) == DHT11_CAPTURE) {
+		queue_work(system_highpri_wq, &dht11->work);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/* dht11_push: Push one scan to the kfifo: temperature, humidity, (pad), timestamp.
+ * The timestamp is the CLOCK_BOOTTIME stamp of the decoded frame, so consumers
+ * see the same value for samples served from the cache.
+ */
+static void dht11_push(struct iio_dev *iio_dev, const struct dht11_sample *sample)
+{
+	struct {
+		s32 channels[2];
+		s64 ts __aligned(8);
+	} scan;
+
+	scan.channels[0] = sample->temperature;
+	scan.channels[1] = sample->humidity;
+
+	iio_push_to_buffers_with_timestamp(iio_dev, &scan, sample->timestamp);
+}
+
+/* dht11_pulse: Pull the line low for the start pulse, the bus must be ours */
+static int dht11_pulse(struct dht11 *dht11)
+{
+	int ret;
+
+	ret = gpio_direction_output(dht11->gpio, 0);
+	if (ret) {
+		return ret;
+	}
+
+	WRITE_ONCE(dht11->state, DHT11_START);
+	trace_dht11_start(dht11->gpio, READ_ONCE(dht11->polling));
+
+	hrtimer_start(&dht11->timer, ns_to_ktime(DHT11_START_TRANSMISSION_MIN * NSEC_PER_USEC), HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+/* dht11_bus_acquire: Take the bus, or queue for it and return false */
+static bool dht11_bus_acquire(struct dht11 *dht11)
+{
+	bool owner;
+
+	spin_lock(&dht11_bus_lock);
+
+	owner = dht11_bus_owner == NULL;
+	if (owner) {
+		dht11_bus_owner = dht11;
+	} else {
+		list_add_tail(&dht11->bus_node, &dht11_bus_waiters);
+	}
+
+	spin_unlock(&dht11_bus_lock);
+
+	return owner;
+}
+
+/* dht11_bus_release: Pass the bus on, returns the queued sensor that now owns it */
+static struct dht11 *dht11_bus_release(void)
+{
+	struct dht11 *next;
+
+	spin_lock(&dht11_bus_lock);
+
+	next = list_first_entry_or_null(&dht11_bus_waiters, struct dht11, bus_node);
+	if (next) {
+		list_del(&next->bus_node);
+	}
+	dht11_bus_owner = next;
+
+	spin_unlock(&dht11_bus_lock);
+
+	return next;
+}
+
+/* dht11_finish: Publish the transaction status, return to DHT11_IDLE and start
+ * the next queued sensor.
+ */
+static void dht11_finish(struct dht11 *dht11, int ret)
+{
+	struct iio_dev *iio_dev = dht11->iio_dev;
+	struct dht11_sample sample;
+	struct dht11_frame frame;
+	struct dht11 *next;
+
+	dev_dbg(dht11->dev, "[+] First edge %lld ns after release\n", dht11->first_edge_latency);
+
+	dht11_stats_finish(dht11, ret);
+
+	dht11->num_edges = -1;
+	dht11->result = ret;
+	sample = dht11->sample;
+
+	smp_store_release(&dht11->state, DHT11_IDLE);
+	complete_all(&dht11->completion);
+
+	if (test_and_clear_bit(DHT11_FLAG_PUSH, &dht11->flags) && !ret && iio_buffer_enabled(iio_dev)) {
+		dht11_push(iio_dev, &sample);
+	}
+
+	/* Wake up poll() on in_sample and hand the frame to the sinks */
+	if (!ret) {
+		sysfs_notify(&iio_dev->dev.kobj, NULL, "in_sample");
+
+		frame.dev = dht11->dev;
+		frame.temperature = sample.temperature;
+		frame.humidity = sample.humidity;
+		frame.timestamp = sample.timestamp;
+		blocking_notifier_call_chain(&dht11_notifier, DHT11_EVENT_FRAME, &frame);
+	}
+
+	next = dht11_bus_release();
+	if (next) {
+		ret = dht11_pulse(next);
+		if (ret) {
+			dht11_finish(next, ret);
+		}
+	}
+}
+
+/* dht11_cycles_per_ms: Rate of get_cycles(), 0 if it doesn't count, as on
+ * 32-bit ARM where it always returns 0. Measured from one clock tick to another
+ * with interrupts on, since a coarse clock doesn't advance with them off.
+ */
+static u32 dht11_cycles_per_ms(void)
+{
+	cycles_t c0, c1;
+	u64 t, t0, t1;
+
+	t = ktime_get_mono_fast_ns();
+	while ((t0 = ktime_get_mono_fast_ns()) == t) {
+		cpu_relax();
+	}
+	c0 = get_cycles();
+
+	msleep(DHT11_POLL_CALIBRATION);
+
+	t = ktime_get_mono_fast_ns();
+	while ((t1 = ktime_get_mono_fast_ns()) == t) {
+		cpu_relax();
+	}
+	c1 = get_cycles();
+
+	return div64_u64((u64)(c1 - c0) * NSEC_PER_MSEC, t1 - t0);
+}
+
+/* dht11_poll_edges: Busy loop over the whole frame with interrupts off, for
+ * systems where the IRQ path loses edges or the clock is too coarse. Edges are
+ * stamped with the cycle counter and converted to ns with poll_rate. The loop
+ * is bounded in cycles too: a coarse clock stands still with interrupts off.
+ */
+static void dht11_poll_edges(struct dht11 *dht11)
+{
+	u32 budget = dht11->poll_rate * (DHT11_POLL_TIMEOUT / NSEC_PER_MSEC);
+	unsigned long flags;
+	cycles_t c0, c;
+	int n = 0, level, value, i;
+	u64 ns;
+
+	local_irq_save(flags);
+
+	c0 = get_cycles();
+	level = gpio_get_value(dht11->gpio);
+
+	do {
+		value = gpio_get_value(dht11->gpio);
+		c = get_cycles();
+
+		if (value == level) {
+			continue;
+		}
+		level = value;
+
+		/* The sensor answers with a falling edge, anything before is our own release */
+		if (n == 0 && value) {
+			continue;
+		}
+
+		dht11->poll_stamps[n] = c - c0;
+		dht11_edge_set_level(&dht11->edges, n, value);
+		++n;
+	} while (n < DHT11_EDGES_PER_READ && c - c0 < budget);
+
+	local_irq_restore(flags);
+
+	for (i = 0; i < n; ++i) {
+		ns = div_u64((u64)dht11->poll_stamps[i] * NSEC_PER_MSEC, dht11->poll_rate);
+
+		dht11->edges.delta[i] = i ? (u32)(ns - dht11->last_ts) : 0;
+		dht11->last_ts = ns;
+
+		if (i == 0) {
+			dht11->first_edge_latency = ns;
+		}
+	}
+	dht11->num_edges = n;
+}
+
+static void dht11_work(struct work_struct *work)
+{
+	struct dht11 *dht11 = container_of(work, struct dht11, work);
+	u32 threshold = READ_ONCE(dht11->threshold);
+	int ret, offset;
+	u64 frame = 0;
+
+	if (READ_ONCE(dht11->state) == DHT11_START) {
+		ret = gpio_direction_input(dht11->gpio);
+		if (ret) {
+			dht11_finish(dht11, ret);
+
+			return;
+		}
+
+		dht11->release_ts = ktime_get_boot_ns();
+		dht11->first_edge_latency = -1;
+		dht11->num_edges = 0;
+
+		if (!READ_ONCE(dht11->polling)) {
+			smp_store_release(&dht11->state, DHT11_CAPTURE);
+
+			hrtimer_start(&dht11->timer, ns_to_ktime(DHT11_FRAME_TIMEOUT), HRTIMER_MODE_REL);
+
+			return;
+		}
+
+		/* The IRQ handler stays out of the way outside DHT11_CAPTURE */
+		WRITE_ONCE(dht11->state, DHT11_DECODE);
+
+		dht11_poll_edges(dht11);
+	}
+
+	/* DHT11_DECODE: The IRQ handler no longer touches edges[] */
+	hrtimer_cancel(&dht11->timer);
+
+#ifdef CONFIG_DYNAMIC_DEBUG
+	dht11_edges_print(dht11);
+#endif
+
+	if (dht11->num_edges < DHT11_EDGES_PER_READ - 1) {
+		dev_err(dht11->dev, "[+] Only %d signal edges detected\n", dht11->num_edges);
+
+		dht11_trace(dht11, -ETIMEDOUT, -1, threshold, 0);
+		dht11_stats_frame(dht11, -ETIMEDOUT, -1);
+		trace_dht11_decode(dht11->gpio, -ETIMEDOUT, dht11->num_edges, -1, threshold, 0, 0);
+		dht11_finish(dht11, -ETIMEDOUT);
+
+		return;
+	}
+
+	ret = -EIO;
+	offset = DHT11_EDGES_PREAMBLE + dht11->num_edges - DHT11_EDGES_PER_READ;
+	for (; offset >= 0; --offset) {
+		ret = dht11_decode(dht11, offset, threshold, &frame);
+		if (!ret) {
+			break;
+		}
+	}
+
+	dht11_trace(dht11, ret, offset, threshold, frame);
+	dht11_stats_frame(dht11, ret, offset);
+	trace_dht11_decode(dht11->gpio, ret, dht11->num_edges, offset, threshold, dht11->sample.temperature, dht11->sample.humidity);
+
+	/* Keep reporting -EIO for both ways a frame can be corrupt */
+	dht11_finish(dht11, ret ? -EIO : 0);
+}
+
+/* dht11_read_snapshot: Lockless read of the last published frame */
+static int dht11_read_snapshot(struct dht11 *dht11, struct dht11_sample *sample)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&dht11->sample_lock);
+		*sample = dht11->sample;
+	} while (read_seqretry(&dht11->sample_lock, seq));
+
+	return sample->frame ? 0 : -EAGAIN;
+}
+
+/* dht11_fresh: The published frame is younger than DHT11_DATA_VALID_TIME */
+static bool dht11_fresh(struct dht11 *dht11, struct dht11_sample *sample)
+{
+	if (dht11_read_snapshot(dht11, sample)) {
+		return false;
+	}
+
+	return sample->timestamp + DHT11_DATA_VALID_TIME >= ktime_get_boot_ns();
+}
+
+/* dht11_start: Kick off a transaction without waiting for it.
+ * Must be called with dht11->lock held. Returns -EBUSY if one is in flight.
+ */
+static int dht11_start(struct iio_dev *iio_dev)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	int ret, timeres;
+
+	if (READ_ONCE(dht11->state) != DHT11_IDLE) {
+		return -EBUSY;
+	}
+
+	timeres = ktime_get_resolution_ns();
+
+	dev_dbg(dht11->dev, "[+] Current timeresolution: %dns\n", timeres);
+
+	/* Polling stamps edges with the cycle counter and doesn't need the clock */
+	if (READ_ONCE(dht11->polling)) {
+		timeres = 0;
+	}
+
+	if (timeres > DHT11_MIN_TIMERES) {
+		dev_err(dht11->dev, "[+] timeresolution %dns too low\n", timeres);
+		/* In theory a better clock could become available
+		 * at some point ... and there is no error code
+		 * that really fits better.
+		 */
+
+		return -EAGAIN;
+	}
+	if (timeres > DHT11_AMBIG_LOW && timeres < DHT11_AMBIG_HIGH) {
+		dev_warn(dht11->dev, "[+] timeresolution: %dns - decoding ambiguous\n", timeres);
+	}
+
+	dht11->start_ts = ktime_get_boot_ns();
+	reinit_completion(&dht11->completion);
+	WRITE_ONCE(dht11->state, DHT11_QUEUED);
+
+	/* dht11_finish() of the current owner starts us */
+	if (!dht11_bus_acquire(dht11)) {
+		return 0;
+	}
+
+	ret = dht11_pulse(dht11);
+	if (ret) {
+		dht11_finish(dht11, ret);
+	}
+
+	return ret;
+}
+
+/* dht11_update: Refresh the cached frame if it is older than DHT11_DATA_VALID_TIME
+ * (or unconditionally if force is set) and wait for it. Must be called with
+ * dht11->lock held.
+ */
+static int dht11_update(struct iio_dev *iio_dev, bool force)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	struct dht11_sample sample;
+	int ret;
+
+	if (!force && dht11_fresh(dht11, &sample)) {
+		dht11_stats_read(dht11, true);
+
+		return 0;
+	}
+
+	dht11_stats_read(dht11, false);
+
+	/* A transaction already in flight delivers a fresh frame just as well */
+	ret = dht11_start(iio_dev);
+	if (ret && ret != -EBUSY) {
+		return ret;
+	}
+
+	ret = wait_for_completion_killable(&dht11->completion);
+	if (ret) {
+		return ret;
+	}
+
+	return dht11->result;
+}
+
+/* dht11_read_sample: Serve readers from the snapshot while background sampling
+ * is running, otherwise acquire a frame on demand.
+ */
+static int dht11_read_sample(struct iio_dev *iio_dev, struct dht11_sample *sample)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	int ret;
 
-#define DHT11_EDGES_PREAMBLE 2
-#define DHT11_BITS_PER_READ 40
+	if (READ_ONCE(dht11->sampling_period)) {
+		dht11_stats_read(dht11, true);
 
-/* Note that when reading the sensor actually 84 edges are detected, but
- * since the last edge is not significant, we only store 83:
- */
-#define DHT11_EDGES_PER_READ (2 * DHT11_BITS_PER_READ + DHT11_EDGES_PREAMBLE + 1)
+		return dht11_read_snapshot(dht11, sample);
+	}
 
-/* Data transmission timing:
- * Data bits are encoded as pulse length (high time) on the data line.
- * 0-bit: 22-30uS -- typically 26uS (AM2302)
- * 1-bit: 68-75uS -- typically 70uS (AM2302)
- * The acutal timings also depend on the properties of the cable, with
- * longer cables typically making pulses shorter.
- *
- * Our decoding depends on the time resolution of the system:
- * timeres > 34uS ... don't know what a 1-tick pulse is
- * 34uS > timeres > 30uS ... no problem (30kHz and 32kHz clocks)
- * 30uS > timeres > 23uS ... don't know what a 2-tick pulse is
- * timeres < 23uS ... no problem
- *
- * Luckily clocks in the 33-44kHz range are quite uncommon, so we can
- * support most systems if the threshold for decoding a pulse as 1-bit
- * is chosen carefully. If somebody really wants to support clocks around
- * 40kHz, where this driver is most unreliable, there are two options.
- * a) select an implementation using busy loop polling on those systems
- * b) use the checksum to do some probabilistic decoding
- */
-#define DHT11_START_TRANSMISSION_MIN 18000 /* us */
-#define DHT11_START_TRANSMISSION_MAX 20000 /* us */
-#define DHT11_MIN_TIMERES 34000 /* ns */
-#define DHT11_THRESHOLD_IN_IRQ 15000 /* ns */
-#define DHT11_THRESHOLD_IN_DECODE_FUNC 49000 /* ns */
-#define DHT11_AMBIG_LOW 23000 /* ns */
-#define DHT11_AMBIG_HIGH 30000 /* ns */
+	/* The buffer owns the sensor while it is enabled */
+	ret = iio_device_claim_direct_mode(iio_dev);
+	if (ret) {
+		return ret;
+	}
 
-struct dht11 {
-	struct device *dev;
+	mutex_lock(&dht11->lock);
 
-	int gpio;
-	int irq;
+	ret = dht11_update(iio_dev, false);
+	if (!ret) {
+		ret = dht11_read_snapshot(dht11, sample);
+	}
 
-	struct completion completion;
-	struct mutex lock; /* The iio sysfs interface doesn't prevent concurrent reads: */
+	mutex_unlock(&dht11->lock);
 
-	s64 timestamp;
-	int temperature;
-	int humidity;
+	iio_device_release_direct_mode(iio_dev);
 
-	int num_edges; /* num_edges: -1 means "no transmission in progress" */
-	struct {
-		s64 ts;
-		int value;
-	} edges[DHT11_EDGES_PER_READ];
-};
+	return ret;
+}
 
-#ifdef CONFIG_DYNAMIC_DEBUG
-/* dht11_edges_print: Show the data as actually received by the driver. */
-static void dht11_edges_print(struct dht11 *dht11)
+/* dht11_sampling_delay: jiffies until the next start of sensor index of N,
+ * which are spread evenly over the period: index * period / N after dht11_epoch.
+ */
+static unsigned long dht11_sampling_delay(struct dht11 *dht11, unsigned int period)
 {
-	int i;
+	unsigned long p = msecs_to_jiffies(period), phase, elapsed;
 
-	dev_dbg(dht11->dev, "[+] %d edges detected:\n", dht11->num_edges);
+	mutex_lock(&dht11_devices_lock);
+	phase = p * dht11->index / dht11_num_devices;
+	mutex_unlock(&dht11_devices_lock);
 
-	for (i = 1; i < dht11->num_edges; ++i) {
-		dev_dbg(dht11->dev, "[+] %d: %lld ns %s\n", i, dht11->edges[i].ts - dht11->edges[i - 1].ts, dht11->edges[i - 1].value ? "high" : "low");
-	}
+	elapsed = (jiffies - dht11_epoch) % p;
+
+	return (phase + p - elapsed) % p;
 }
-#endif /* CONFIG_DYNAMIC_DEBUG */
 
-static unsigned char dht11_decode_byte(char *bits)
+static void dht11_sampling_work(struct work_struct *work)
 {
-	unsigned char ret = 0;
-	int i;
+	struct dht11 *dht11 = container_of(to_delayed_work(work), struct dht11, sampling_work);
+	unsigned long delay;
+	unsigned int period;
 
-	for (i = 0; i < 8; ++i) {
-		ret <<= 1;
+	mutex_lock(&dht11->lock);
+	dht11_start(dht11->iio_dev);
+	mutex_unlock(&dht11->lock);
 
-		if (bits[i]) {
-			++ret;
+	period = READ_ONCE(dht11->sampling_period);
+	if (period) {
+		/* Woken up a little early, the slot just served is not the next one */
+		delay = dht11_sampling_delay(dht11, period);
+		if (delay < msecs_to_jiffies(period) / 2) {
+			delay += msecs_to_jiffies(period);
 		}
+
+		schedule_delayed_work(&dht11->sampling_work, delay);
 	}
+}
 
-	return ret;
+/* dht11_renumber: Recompute the sampling phases, dht11_devices_lock held */
+static void dht11_renumber(void)
+{
+	struct dht11 *dht11;
+	unsigned int index = 0;
+
+	list_for_each_entry(dht11, &dht11_devices, node) {
+		dht11->index = index++;
+	}
+	dht11_num_devices = index;
+}
+
+static void dht11_devices_del(void *data)
+{
+	struct dht11 *dht11 = data;
+
+	mutex_lock(&dht11_devices_lock);
+	list_del(&dht11->node);
+	dht11_renumber();
+	mutex_unlock(&dht11_devices_lock);
 }
 
-static int dht11_decode(struct dht11 *dht11, int offset)
+static void dht11_stop(void *data)
 {
-	int i, t;
-	char bits[DHT11_BITS_PER_READ];
-	unsigned char temp_int, temp_dec, hum_int, hum_dec, checksum;
+	struct dht11 *dht11 = data;
 
-	dev_info(dht11->dev, "[+] dht11_decode enter\n");
+	WRITE_ONCE(dht11->sampling_period, 0);
+	cancel_delayed_work_sync(&dht11->sampling_work);
 
-	for (i = 0; i < DHT11_BITS_PER_READ; ++i) {
-		t = dht11->edges[offset + 2 * i + 2].ts - dht11->edges[offset + 2 * i + 1].ts;
+	/* Let an in-flight transaction run into its frame timeout at worst */
+	wait_for_completion(&dht11->completion);
+	cancel_work_sync(&dht11->work);
+}
 
-		if (!dht11->edges[offset + 2 * i + 1].value) {
-			dev_dbg(dht11->dev, "[+] Lost synchronisation at edge %d\n", offset + 2 * i + 1);
+static int dht11_read_raw(struct iio_dev *iio_dev, const struct iio_chan_spec *chan, int *val, int *val2, long m)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	struct dht11_sample sample;
+	unsigned int period, freq;
+	int ret;
 
-			return -EIO;
-		}
+	if (m == IIO_CHAN_INFO_SAMP_FREQ) {
+		period = READ_ONCE(dht11->sampling_period);
+		freq = period ? 1000000000U / period : 0; /* uHz */
 
-		bits[i] = t > DHT11_THRESHOLD_IN_DECODE_FUNC;
+		*val = freq / 1000000;
+		*val2 = freq % 1000000;
+
+		return IIO_VAL_INT_PLUS_MICRO;
+	}
+
+	/* No logging here: every sample would cost a trip through printk, see debugfs "stats" */
+	ret = dht11_read_sample(iio_dev, &sample);
+	if (ret) {
+		return ret;
+	}
+
+	if (chan->type == IIO_TEMP) {
+		*val = sample.temperature;
+	} else if (chan->type == IIO_HUMIDITYRELATIVE) {
+		*val = sample.humidity;
+	} else {
+		return -EINVAL;
 	}
 
-	hum_int = dht11_decode_byte(bits);
-	hum_dec = dht11_decode_byte(&bits[8]);
-	temp_int = dht11_decode_byte(&bits[16]);
-	temp_dec = dht11_decode_byte(&bits[24]);
-	checksum = dht11_decode_byte(&bits[32]);
+	return IIO_VAL_INT;
+}
 
-	if (((hum_int + hum_dec + temp_int + temp_dec) & 0xff) != checksum) {
-		dev_dbg(dht11->dev, "[+] Invalid checksum\n");
+/* sampling_frequency: 0 stops background sampling, at most DHT11_MAX_SAMPLING_FREQ */
+static int dht11_write_raw(struct iio_dev *iio_dev, const struct iio_chan_spec *chan, int val, int val2, long m)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	unsigned int period;
 
-		return -EIO;
+	if (m != IIO_CHAN_INFO_SAMP_FREQ) {
+		return -EINVAL;
 	}
 
-	dht11->timestamp = ktime_get_boot_ns();
+	if (val || val2 < 0 || val2 > DHT11_MAX_SAMPLING_FREQ) {
+		return -EINVAL;
+	}
 
-//	if (hum_int < 20) {  /* DHT22 */
-//		dht11->temperature = (((temp_int & 0x7f) << 8) + temp_dec) * ((temp_int & 0x80) ? -100 : 100);
-//		dht11->humidity = ((hum_int << 8) + hum_dec) * 100;
-//	} else if (temp_dec == 0 && hum_dec == 0) {  /* DHT11 */
-//		dht11->temperature = temp_int * 1000;
-//		dht11->humidity = hum_int * 1000;
-//	} else {
-//		dev_err(dht11->dev, "[+] Don't know how to decode data: %d %d %d %d\n", hum_int, hum_dec, temp_int, temp_dec);
-//
-//		return -EIO;
-//	}
+	period = val2 ? 1000000000U / val2 : 0; /* ms */
 
-	dht11->temperature = temp_int;
-	dht11->humidity = hum_int;
+	mutex_lock(&dht11->lock);
+	WRITE_ONCE(dht11->sampling_period, period);
+	mutex_unlock(&dht11->lock);
 
-	dev_info(dht11->dev, "[+] dht11_decode exit\n");
+	if (period) {
+		mod_delayed_work(system_wq, &dht11->sampling_work, dht11_sampling_delay(dht11, period));
+	} else {
+		cancel_delayed_work_sync(&dht11->sampling_work);
+	}
 
 	return 0;
 }
 
-/* IRQ handler called on GPIO edges */
-static irqreturn_t dht11_handle_irq(int irq, void *data)
+/* in_sample: Temperature, humidity and frame timestamp from one decoded frame */
+static ssize_t dht11_show_sample(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	struct iio_dev *iio = data;
-	struct dht11 *dht11 = iio_priv(iio);
+	struct iio_dev *iio_dev = dev_to_iio_dev(dev);
+	struct dht11_sample sample;
+	int ret;
 
-	/* TODO: Consider making the handler safe for IRQ sharing */
-	if (dht11->num_edges < DHT11_EDGES_PER_READ && dht11->num_edges >= 0) {
-		dht11->edges[dht11->num_edges].ts = ktime_get_boot_ns();
+	ret = dht11_read_sample(iio_dev, &sample);
+	if (ret) {
+		return ret;
+	}
 
-		if (dht11->num_edges >= 1 && (dht11->edges[dht11->num_edges].ts - dht11->edges[dht11->num_edges - 1].ts) < DHT11_THRESHOLD_IN_IRQ) {
-			--dht11->num_edges;
+	return sprintf(buf, "%d %d %lld\n", sample.temperature, sample.humidity, sample.timestamp);
+}
+static IIO_DEVICE_ATTR(in_sample, S_IRUGO, dht11_show_sample, NULL, 0);
 
-			return IRQ_HANDLED;
-		}
+/* threshold_mode: "fixed" uses DHT11_THRESHOLD_IN_DECODE_FUNC, "adaptive" learns it */
+static ssize_t dht11_show_threshold_mode(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct dht11 *dht11 = iio_priv(dev_to_iio_dev(dev));
+
+	return sprintf(buf, "%s\n", READ_ONCE(dht11->adaptive) ? "adaptive" : "fixed");
+}
+
+static ssize_t dht11_store_threshold_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct dht11 *dht11 = iio_priv(dev_to_iio_dev(dev));
+	bool adaptive;
+
+	if (sysfs_streq(buf, "adaptive")) {
+		adaptive = true;
+	} else if (sysfs_streq(buf, "fixed")) {
+		adaptive = false;
+	} else {
+		return -EINVAL;
+	}
+
+	/* Serialised against the decoder, which only runs inside a transaction */
+	mutex_lock(&dht11->lock);
+	wait_for_completion(&dht11->completion);
+
+	if (adaptive && !dht11->adaptive) {
+		dht11_threshold_init(&dht11->model);
+	}
+	WRITE_ONCE(dht11->adaptive, adaptive);
+	WRITE_ONCE(dht11->threshold, adaptive ? dht11_threshold(&dht11->model) : DHT11_THRESHOLD_IN_DECODE_FUNC);
+
+	mutex_unlock(&dht11->lock);
+
+	return count;
+}
+static IIO_DEVICE_ATTR(threshold_mode, S_IRUGO | S_IWUSR, dht11_show_threshold_mode, dht11_store_threshold_mode, 0);
+
+/* threshold: Pulse length in ns the decoder currently splits 0- and 1-bits at */
+static ssize_t dht11_show_threshold(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct dht11 *dht11 = iio_priv(dev_to_iio_dev(dev));
+
+	return sprintf(buf, "%u\n", READ_ONCE(dht11->threshold));
+}
+static IIO_DEVICE_ATTR(threshold, S_IRUGO, dht11_show_threshold, NULL, 0);
+
+/* acquisition_mode: "irq" timestamps edges in the IRQ handler, "poll" busy-loops */
+static ssize_t dht11_show_acquisition_mode(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct dht11 *dht11 = iio_priv(dev_to_iio_dev(dev));
+
+	return sprintf(buf, "%s\n", READ_ONCE(dht11->polling) ? "poll" : "irq");
+}
+
+static ssize_t dht11_store_acquisition_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct dht11 *dht11 = iio_priv(dev_to_iio_dev(dev));
+	bool polling;
+	u32 rate = 0;
+
+	if (sysfs_streq(buf, "poll")) {
+		polling = true;
+	} else if (sysfs_streq(buf, "irq")) {
+		polling = false;
+	} else {
+		return -EINVAL;
+	}
 
-		dht11->edges[dht11->num_edges++].value = gpio_get_value(dht11->gpio);
+	/* Without a cycle counter the busy loop could neither stamp edges nor end */
+	if (polling) {
+		rate = dht11_cycles_per_ms();
+		if (!rate) {
+			dev_err(dev, "[+] No cycle counter, polling is not supported\n");
 
-		if (dht11->num_edges >= DHT11_EDGES_PER_READ) {
-			complete(&dht11->completion);
+			return -EOPNOTSUPP;
 		}
 	}
 
-	return IRQ_HANDLED;
+	/* Never switch engines in the middle of a transaction */
+	mutex_lock(&dht11->lock);
+	wait_for_completion(&dht11->completion);
+	if (polling) {
+		dht11->poll_rate = rate;
+	}
+	WRITE_ONCE(dht11->polling, polling);
+	mutex_unlock(&dht11->lock);
+
+	return count;
 }
+static IIO_DEVICE_ATTR(acquisition_mode, S_IRUGO | S_IWUSR, dht11_show_acquisition_mode, dht11_store_acquisition_mode, 0);
+
+static struct attribute *dht11_attributes[] = {
+	&iio_dev_attr_in_sample.dev_attr.attr,
+	&iio_dev_attr_threshold_mode.dev_attr.attr,
+	&iio_dev_attr_threshold.dev_attr.attr,
+	&iio_dev_attr_acquisition_mode.dev_attr.attr,
+	NULL,
+};
 
-static int dht11_read_raw(struct iio_dev *iio_dev, const struct iio_chan_spec *chan, int *val, int *val2, long m)
+static const struct attribute_group dht11_attribute_group = {
+	.attrs = dht11_attributes,
+};
+
+static int dht11_event_index(enum iio_event_type type, enum iio_event_direction dir)
+{
+	if (type != IIO_EV_TYPE_THRESH) {
+		return -EINVAL;
+	}
+
+	if (dir == IIO_EV_DIR_RISING) {
+		return DHT11_EV_RISING;
+	} else if (dir == IIO_EV_DIR_FALLING) {
+		return DHT11_EV_FALLING;
+	}
+
+	return -EINVAL;
+}
+
+static int dht11_read_event_config(struct iio_dev *iio_dev, const struct iio_chan_spec *chan,
+		enum iio_event_type type, enum iio_event_direction dir)
 {
 	struct dht11 *dht11 = iio_priv(iio_dev);
-	int ret, timeres, offset;
+	int i = dht11_event_index(type, dir);
 
-	dev_info(dht11->dev, "[+] dht11_read_raw enter\n");
+	if (i < 0) {
+		return i;
+	}
 
-	mutex_lock(&dht11->lock);
-	if (dht11->timestamp + DHT11_DATA_VALID_TIME < ktime_get_boot_ns()) {
-		timeres = ktime_get_resolution_ns();
+	return READ_ONCE(dht11->event_enabled[i]);
+}
 
-		dev_dbg(dht11->dev, "[+] Current timeresolution: %dns\n", timeres);
+static int dht11_write_event_config(struct iio_dev *iio_dev, const struct iio_chan_spec *chan,
+		enum iio_event_type type, enum iio_event_direction dir, int state)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	int i = dht11_event_index(type, dir);
 
-		if (timeres > DHT11_MIN_TIMERES) {
-			dev_err(dht11->dev, "[+] timeresolution %dns too low\n", timeres);
-			/* In theory a better clock could become available
-			 * at some point ... and there is no error code
-			 * that really fits better.
-			 */
+	if (i < 0) {
+		return i;
+	}
 
-			ret = -EAGAIN;
+	WRITE_ONCE(dht11->event_enabled[i], !!state);
 
-			goto err;
-		}
-		if (timeres > DHT11_AMBIG_LOW && timeres < DHT11_AMBIG_HIGH) {
-			dev_warn(dht11->dev, "[+] timeresolution: %dns - decoding ambiguous\n", timeres);
-		}
+	return 0;
+}
 
-		reinit_completion(&dht11->completion);
+static int dht11_read_event_value(struct iio_dev *iio_dev, const struct iio_chan_spec *chan,
+		enum iio_event_type type, enum iio_event_direction dir, enum iio_event_info info, int *val, int *val2)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	int i = dht11_event_index(type, dir);
 
-		dht11->num_edges = 0;
-		ret = gpio_direction_output(dht11->gpio, 0);
-		if (ret) {
-			goto err;
-		}
-		usleep_range(DHT11_START_TRANSMISSION_MIN, DHT11_START_TRANSMISSION_MAX);
+	if (i < 0 || info != IIO_EV_INFO_VALUE) {
+		return -EINVAL;
+	}
 
-		ret = gpio_direction_input(dht11->gpio);
-		if (ret) {
-			goto err;
-		}
+	*val = READ_ONCE(dht11->event_value[i]);
 
-		ret = request_irq(dht11->irq, dht11_handle_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, iio_dev->name, iio_dev);
-		if (ret) {
-			goto err;
-		}
+	return IIO_VAL_INT;
+}
+
+/* Events are checked on every decoded frame, so they only fire while frames are
+ * acquired: in background sampling mode, or on reads.
+ */
+static int dht11_write_event_value(struct iio_dev *iio_dev, const struct iio_chan_spec *chan,
+		enum iio_event_type type, enum iio_event_direction dir, enum iio_event_info info, int val, int val2)
+{
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	int i = dht11_event_index(type, dir);
 
-		ret = wait_for_completion_killable_timeout(&dht11->completion, HZ);
+	if (i < 0 || info != IIO_EV_INFO_VALUE || val2) {
+		return -EINVAL;
+	}
 
-		free_irq(dht11->irq, iio_dev);
+	WRITE_ONCE(dht11->event_value[i], val);
 
-#ifdef CONFIG_DYNAMIC_DEBUG
-		dht11_edges_print(dht11);
-#endif
+	return 0;
+}
 
-		if (ret == 0 && dht11->num_edges < DHT11_EDGES_PER_READ - 1) {
-			dev_err(dht11->dev, "[+] Only %d signal edges detected\n", dht11->num_edges);
+/* dht11_trigger_handler: One scan per trigger. A stale frame is not waited for:
+ * the transaction is started and dht11_finish() pushes the scan, so readers of
+ * the buffer chardev get -EAGAIN (O_NONBLOCK) or a poll() wakeup meanwhile.
+ */
+static irqreturn_t dht11_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *iio_dev = pf->indio_dev;
+	struct dht11 *dht11 = iio_priv(iio_dev);
+	struct dht11_sample sample;
+	int ret;
 
-			ret = -ETIMEDOUT;
-		}
-		if (ret < 0) {
-			goto err;
-		}
+	if (READ_ONCE(dht11->sampling_period)) {
+		dht11_stats_read(dht11, true);
+
+		ret = dht11_read_snapshot(dht11, &sample);
+	} else {
+		mutex_lock(&dht11->lock);
 
-		offset = DHT11_EDGES_PREAMBLE + dht11->num_edges - DHT11_EDGES_PER_READ;
-		for (; offset >= 0; --offset) {
-			ret = dht11_decode(dht11, offset);
-			if (!ret) {
-				break;
+		ret = 0;
+
+		if (dht11_fresh(dht11, &sample)) {
+			dht11_stats_read(dht11, true);
+		} else {
+			dht11_stats_read(dht11, false);
+			set_bit(DHT11_FLAG_PUSH, &dht11->flags);
+
+			ret = dht11_start(iio_dev);
+			if (ret && ret != -EBUSY) {
+				clear_bit(DHT11_FLAG_PUSH, &dht11->flags);
 			}
-		}
 
-		if (ret) {
-			goto err;
+			ret = -EINPROGRESS;
 		}
-	}
 
-	ret = IIO_VAL_INT;
-	if (chan->type == IIO_TEMP) {
-		*val = dht11->temperature;
-	} else if (chan->type == IIO_HUMIDITYRELATIVE) {
-		*val = dht11->humidity;
-	} else {
-		ret = -EINVAL;
+		mutex_unlock(&dht11->lock);
 	}
 
-err:
-	dht11->num_edges = -1;
-
-	mutex_unlock(&dht11->lock);
+	if (!ret) {
+		dht11_push(iio_dev, &sample);
+	}
 
-	dev_info(dht11->dev, "[+] dht11_read_raw exit\n");
+	iio_trigger_notify_done(iio_dev->trig);
 
-	return ret;
+	return IRQ_HANDLED;
 }
 
 static const struct iio_info dht11_iio_info = {
 	.driver_module = THIS_MODULE,
 	.read_raw = dht11_read_raw,
+	.write_raw = dht11_write_raw,
+	.read_event_config = dht11_read_event_config,
+	.write_event_config = dht11_write_event_config,
+	.read_event_value = dht11_read_event_value,
+	.write_event_value = dht11_write_event_value,
+	.attrs = &dht11_attribute_group,
+};
+
+static const struct iio_event_spec dht11_temp_events[] = {
+	{
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_RISING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+	}, {
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_FALLING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+	},
 };
 
 static const struct iio_chan_spec dht11_chan_spec[] = {
 	{
 		.type = IIO_TEMP,
 		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
+		.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.event_spec = dht11_temp_events,
+		.num_event_specs = ARRAY_SIZE(dht11_temp_events),
+		.scan_index = 0,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
 	}, {
 		.type = IIO_HUMIDITYRELATIVE,
 		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
-	}
+		.info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.scan_index = 1,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(2),
 };
 
+/* dht11_push() always fills both channels, the core demuxes the ones enabled */
+static const unsigned long dht11_scan_masks[] = { BIT(0) | BIT(1), 0 };
+
 static const struct of_device_id dht11_dt_ids[] = {
 	{ .compatible = "arrow,my_dht11", },
 	{ }
@@ -343,6 +1553,7 @@ static int dht11_probe(struct platform_device *pdev)
 
 	dht11 = iio_priv(iio);
 	dht11->dev = dev;
+	dht11->iio_dev = iio;
 
 	ret = of_get_gpio(node, 0);
 	if (ret < 0) {
@@ -361,19 +1572,75 @@ static int dht11_probe(struct platform_device *pdev)
 		return -EINVAL;
 	}
 
-	dht11->timestamp = ktime_get_boot_ns() - DHT11_DATA_VALID_TIME - 1;
+	dht11->sample.timestamp = ktime_get_boot_ns() - DHT11_DATA_VALID_TIME - 1;
+	dht11->threshold = DHT11_THRESHOLD_IN_DECODE_FUNC;
+	dht11->event_value[DHT11_EV_RISING] = DHT11_EV_RISING_DEFAULT;
+	dht11->event_value[DHT11_EV_FALLING] = DHT11_EV_FALLING_DEFAULT;
+	dht11_threshold_init(&dht11->model);
 	dht11->num_edges = -1;
 
+	ret = dht11_debugfs_init(dht11);
+	if (ret) {
+		return ret;
+	}
+
 	platform_set_drvdata(pdev, iio);
 
 	init_completion(&dht11->completion);
+	complete_all(&dht11->completion); /* DHT11_IDLE */
 	mutex_init(&dht11->lock);
+	seqlock_init(&dht11->sample_lock);
+	INIT_DELAYED_WORK(&dht11->sampling_work, dht11_sampling_work);
+
+	dht11->state = DHT11_IDLE;
+	hrtimer_init(&dht11->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dht11->timer.function = dht11_timer;
+	INIT_WORK(&dht11->work, dht11_work);
+
+	mutex_lock(&dht11_devices_lock);
+	if (list_empty(&dht11_devices)) {
+		dht11_epoch = jiffies;
+	}
+	list_add_tail(&dht11->node, &dht11_devices);
+	dht11_renumber();
+	mutex_unlock(&dht11_devices_lock);
+
+	ret = devm_add_action_or_reset(dev, dht11_devices_del, dht11);
+	if (ret) {
+		return ret;
+	}
+
+	/* Requested once: dht11_handle_irq() ignores edges outside DHT11_CAPTURE */
+	ret = devm_request_irq(dev, dht11->irq, dht11_handle_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_SHARED, pdev->name, iio);
+	if (ret) {
+		dev_err(dev, "[+] Failed to request IRQ %d\n", dht11->irq);
+
+		return ret;
+	}
+
+	/* Added after the IRQ, so it runs before devm frees it: a capture in
+	 * flight still completes through dht11_handle_irq(). It also runs before
+	 * dht11_devices_del(), so sampling never sees an empty list.
+	 */
+	ret = devm_add_action(dev, dht11_stop, dht11);
+	if (ret) {
+		return ret;
+	}
+
 	iio->name = pdev->name;
 	iio->dev.parent = &pdev->dev;
 	iio->info = &dht11_iio_info;
 	iio->modes = INDIO_DIRECT_MODE;
 	iio->channels = dht11_chan_spec;
 	iio->num_channels = ARRAY_SIZE(dht11_chan_spec);
+	iio->available_scan_masks = dht11_scan_masks;
+
+	ret = devm_iio_triggered_buffer_setup(dev, iio, iio_pollfunc_store_time, dht11_trigger_handler, NULL);
+	if (ret) {
+		dev_err(dev, "[+] Failed to setup triggered buffer\n");
+
+		return ret;
+	}
 
 	dev_info(dev, "[+] dht11_probe exit\n");
 
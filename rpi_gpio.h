@@ -0,0 +1,408 @@
+/*
+ * GPIO backends of the LEDs and buzzer drivers
+ *
+ * The drivers drive their pins through masks of BCM GPIO numbers, bit n for
+ * GPIO n as GPSET0 and GPCLR0 take them, and the backend chosen by their
+ * gpio_backend module parameter does the rest:
+ *   mmio  - GPFSEL, GPSET0 and GPCLR0 of the BCM2837 at their fixed address,
+ *           one register write per set or clear, whatever pins they cover
+ *   gpiod - descriptors of the "<con_id>-gpios" DT property, listed in the
+ *           order of the driver's pins, for any SoC with a GPIO driver
+ *   mock  - no hardware at all, every transition is logged with its
+ *           timestamp to debugfs (<name>/transitions) so toggle rates and
+ *           timer jitter can be measured on any machine
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RPI_GPIO_H
+#define RPI_GPIO_H
+
+#include <linux/io.h> /* ioremap(), iowrite32() */
+#include <linux/gpio/consumer.h> /* devm_gpiod_get_array(), gpiod_set_value() */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define RPI_GPIO_BASE 0x3F200000 /* BCM2710_PERI_BASE + 0x200000 */
+#define RPI_GPIO_SIZE 0xB4
+#define RPI_GPFSEL(pin) (((pin) / 10) * 4)
+#define RPI_GPSET0 0x1C
+#define RPI_GPCLR0 0x28
+
+#define RPI_GPIO_LOG 4096 /* Transitions kept by the mock backend */
+
+struct rpi_gpio_transition {
+	u64 timestamp; /* ktime_get_ns() */
+	u8 pin;
+	u8 value;
+};
+
+struct rpi_gpio;
+
+struct rpi_gpio_ops {
+	const char *name;
+	int (*init)(struct rpi_gpio *gpio, struct device *dev);
+	void (*exit)(struct rpi_gpio *gpio);
+	void (*set)(struct rpi_gpio *gpio, u32 mask); /* Drive high */
+	void (*clear)(struct rpi_gpio *gpio, u32 mask); /* Drive low */
+	bool shared; /* Any instance can set and clear the pins of all of them */
+};
+
+struct rpi_gpio {
+	const char *name; /* debugfs directory of the mock backend */
+	const char *con_id; /* "<con_id>-gpios" of the gpiod backend */
+	const unsigned int *pins; /* BCM numbers, all below 32 */
+	unsigned int num_pins;
+	const struct rpi_gpio_ops *ops; /* NULL until rpi_gpio_init() */
+
+	void __iomem *base; /* mmio */
+	struct gpio_descs *descs; /* gpiod */
+
+	/* mock */
+	spinlock_t lock;
+	u32 level;
+	struct rpi_gpio_transition *log;
+	unsigned int head; /* Next slot of log */
+	u64 transitions; /* All of them, log only keeps the last RPI_GPIO_LOG */
+	struct dentry *debugfs;
+};
+
+static inline u32 rpi_gpio_mask(const struct rpi_gpio *gpio)
+{
+	u32 mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < gpio->num_pins; ++i) {
+		mask |= BIT(gpio->pins[i]);
+	}
+
+	return mask;
+}
+
+static inline int rpi_gpio_mmio_init(struct rpi_gpio *gpio, struct device *dev)
+{
+	unsigned int i, pin;
+	u32 fsel;
+
+	gpio->base = ioremap(RPI_GPIO_BASE, RPI_GPIO_SIZE);
+	if (!gpio->base) {
+		return -ENOMEM;
+	}
+
+	/* Set to 0 the 3 bits of each FSEL and keep the rest, then set the first to select the output function */
+	for (i = 0; i < gpio->num_pins; ++i) {
+		pin = gpio->pins[i];
+		fsel = ioread32(gpio->base + RPI_GPFSEL(pin));
+		fsel = (fsel & ~(0b111 << ((pin % 10) * 3))) | (1 << ((pin % 10) * 3));
+		iowrite32(fsel, gpio->base + RPI_GPFSEL(pin));
+	}
+
+	return 0;
+}
+
+static inline void rpi_gpio_mmio_exit(struct rpi_gpio *gpio)
+{
+	iounmap(gpio->base);
+}
+
+static inline void rpi_gpio_mmio_set(struct rpi_gpio *gpio, u32 mask)
+{
+	iowrite32(mask, gpio->base + RPI_GPSET0);
+}
+
+static inline void rpi_gpio_mmio_clear(struct rpi_gpio *gpio, u32 mask)
+{
+	iowrite32(mask, gpio->base + RPI_GPCLR0);
+}
+
+static inline int rpi_gpio_gpiod_init(struct rpi_gpio *gpio, struct device *dev)
+{
+	unsigned int i;
+
+	gpio->descs = devm_gpiod_get_array(dev, gpio->con_id, GPIOD_OUT_LOW);
+	if (IS_ERR(gpio->descs)) {
+		return PTR_ERR(gpio->descs);
+	}
+
+	if (gpio->descs->ndescs != gpio->num_pins) {
+		dev_err(dev, "[+] %s-gpios has %u pins, expected %u\n", gpio->con_id, gpio->descs->ndescs, gpio->num_pins);
+
+		return -EINVAL;
+	}
+
+	/* Pins are driven from timers, which can't sleep */
+	for (i = 0; i < gpio->num_pins; ++i) {
+		if (gpiod_cansleep(gpio->descs->desc[i])) {
+			dev_err(dev, "[+] %s-gpios pin %u sits on a chip that sleeps\n", gpio->con_id, i);
+
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static inline void rpi_gpio_gpiod_exit(struct rpi_gpio *gpio)
+{
+	/* devm releases the descriptors */
+}
+
+static inline void rpi_gpio_gpiod_write(struct rpi_gpio *gpio, u32 mask, int value)
+{
+	unsigned int i;
+
+	for (i = 0; i < gpio->num_pins; ++i) {
+		if (mask & BIT(gpio->pins[i])) {
+			gpiod_set_value(gpio->descs->desc[i], value);
+		}
+	}
+}
+
+static inline void rpi_gpio_gpiod_set(struct rpi_gpio *gpio, u32 mask)
+{
+	rpi_gpio_gpiod_write(gpio, mask, 1);
+}
+
+static inline void rpi_gpio_gpiod_clear(struct rpi_gpio *gpio, u32 mask)
+{
+	rpi_gpio_gpiod_write(gpio, mask, 0);
+}
+
+/* rpi_gpio_mock_show: "timestamp pin value" per transition, oldest first */
+static inline int rpi_gpio_mock_show(struct seq_file *s, void *unused)
+{
+	struct rpi_gpio *gpio = s->private;
+	struct rpi_gpio_transition *t;
+	unsigned int i, num, first;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gpio->lock, flags);
+
+	num = min_t(u64, gpio->transitions, RPI_GPIO_LOG);
+	first = gpio->transitions > RPI_GPIO_LOG ? gpio->head : 0;
+
+	seq_printf(s, "transitions %llu level 0x%08x\n", gpio->transitions, gpio->level);
+	for (i = 0; i < num; ++i) {
+		t = &gpio->log[(first + i) % RPI_GPIO_LOG];
+		seq_printf(s, "%llu %u %u\n", t->timestamp, t->pin, t->value);
+	}
+
+	spin_unlock_irqrestore(&gpio->lock, flags);
+
+	return 0;
+}
+
+static inline int rpi_gpio_mock_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rpi_gpio_mock_show, inode->i_private);
+}
+
+/* rpi_gpio_mock_clear_log: Any write starts a new measurement */
+static inline ssize_t rpi_gpio_mock_clear_log(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct rpi_gpio *gpio = ((struct seq_file *)file->private_data)->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gpio->lock, flags);
+	gpio->head = 0;
+	gpio->transitions = 0;
+	spin_unlock_irqrestore(&gpio->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations rpi_gpio_mock_fops = {
+	.owner = THIS_MODULE,
+	.open = rpi_gpio_mock_open,
+	.read = seq_read,
+	.write = rpi_gpio_mock_clear_log,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static inline int rpi_gpio_mock_init(struct rpi_gpio *gpio, struct device *dev)
+{
+	gpio->log = devm_kcalloc(dev, RPI_GPIO_LOG, sizeof(*gpio->log), GFP_KERNEL);
+	if (!gpio->log) {
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&gpio->lock);
+	gpio->level = 0;
+	gpio->head = 0;
+	gpio->transitions = 0;
+
+	gpio->debugfs = debugfs_create_dir(gpio->name, NULL);
+	debugfs_create_file("transitions", 0644, gpio->debugfs, gpio, &rpi_gpio_mock_fops);
+
+	return 0;
+}
+
+static inline void rpi_gpio_mock_exit(struct rpi_gpio *gpio)
+{
+	debugfs_remove_recursive(gpio->debugfs);
+}
+
+/* rpi_gpio_mock_write: Log the pins of mask whose level changes */
+static inline void rpi_gpio_mock_write(struct rpi_gpio *gpio, u32 mask, int value)
+{
+	u64 now = ktime_get_ns();
+	struct rpi_gpio_transition *t;
+	unsigned long flags;
+	unsigned int i, pin;
+
+	spin_lock_irqsave(&gpio->lock, flags);
+
+	for (i = 0; i < gpio->num_pins; ++i) {
+		pin = gpio->pins[i];
+		if (!(mask & BIT(pin)) || !!(gpio->level & BIT(pin)) == value) {
+			continue;
+		}
+
+		gpio->level ^= BIT(pin);
+
+		t = &gpio->log[gpio->head];
+		t->timestamp = now;
+		t->pin = pin;
+		t->value = value;
+		gpio->head = (gpio->head + 1) % RPI_GPIO_LOG;
+		++gpio->transitions;
+	}
+
+	spin_unlock_irqrestore(&gpio->lock, flags);
+}
+
+static inline void rpi_gpio_mock_set(struct rpi_gpio *gpio, u32 mask)
+{
+	rpi_gpio_mock_write(gpio, mask, 1);
+}
+
+static inline void rpi_gpio_mock_clear(struct rpi_gpio *gpio, u32 mask)
+{
+	rpi_gpio_mock_write(gpio, mask, 0);
+}
+
+static const struct rpi_gpio_ops rpi_gpio_backends[] = {
+	{
+		.name = "mmio",
+		.init = rpi_gpio_mmio_init,
+		.exit = rpi_gpio_mmio_exit,
+		.set = rpi_gpio_mmio_set,
+		.clear = rpi_gpio_mmio_clear,
+		.shared = true,
+	}, {
+		.name = "gpiod",
+		.init = rpi_gpio_gpiod_init,
+		.exit = rpi_gpio_gpiod_exit,
+		.set = rpi_gpio_gpiod_set,
+		.clear = rpi_gpio_gpiod_clear,
+	}, {
+		.name = "mock",
+		.init = rpi_gpio_mock_init,
+		.exit = rpi_gpio_mock_exit,
+		.set = rpi_gpio_mock_set,
+		.clear = rpi_gpio_mock_clear,
+	},
+};
+
+/* rpi_gpio_backend: The backend called name, NULL if there is none */
+static inline const struct rpi_gpio_ops *rpi_gpio_backend(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rpi_gpio_backends); ++i) {
+		if (sysfs_streq(name, rpi_gpio_backends[i].name)) {
+			return &rpi_gpio_backends[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* rpi_gpio_init: Set up the backend called name, with every pin an output driven low */
+static inline int rpi_gpio_init(struct rpi_gpio *gpio, struct device *dev, const char *name)
+{
+	const struct rpi_gpio_ops *ops = rpi_gpio_backend(name);
+	int ret_val;
+
+	if (!ops) {
+		dev_err(dev, "[+] Unknown GPIO backend %s\n", name);
+
+		return -EINVAL;
+	}
+
+	ret_val = ops->init(gpio, dev);
+	if (ret_val) {
+		return ret_val;
+	}
+
+	ops->clear(gpio, rpi_gpio_mask(gpio));
+
+	/* Set and clear are no-ops until the backend is ready */
+	smp_store_release(&gpio->ops, ops);
+
+	dev_info(dev, "[+] GPIO backend %s\n", ops->name);
+
+	return 0;
+}
+
+/* rpi_gpio_exit: Drive every pin low and release the backend. Callers stop
+ * setting and clearing pins first.
+ */
+static inline void rpi_gpio_exit(struct rpi_gpio *gpio)
+{
+	const struct rpi_gpio_ops *ops = gpio->ops;
+
+	if (!ops) {
+		return;
+	}
+
+	WRITE_ONCE(gpio->ops, NULL);
+
+	ops->clear(gpio, rpi_gpio_mask(gpio));
+	ops->exit(gpio);
+}
+
+static inline void rpi_gpio_set(struct rpi_gpio *gpio, u32 mask)
+{
+	const struct rpi_gpio_ops *ops = smp_load_acquire(&gpio->ops);
+
+	if (ops) {
+		ops->set(gpio, mask);
+	}
+}
+
+static inline void rpi_gpio_clear(struct rpi_gpio *gpio, u32 mask)
+{
+	const struct rpi_gpio_ops *ops = smp_load_acquire(&gpio->ops);
+
+	if (ops) {
+		ops->clear(gpio, mask);
+	}
+}
+
+/* rpi_gpio_write: Drive clear low and set high, one call each at most */
+static inline void rpi_gpio_write(struct rpi_gpio *gpio, u32 set, u32 clear)
+{
+	const struct rpi_gpio_ops *ops = smp_load_acquire(&gpio->ops);
+
+	if (!ops) {
+		return;
+	}
+
+	if (clear) {
+		ops->clear(gpio, clear);
+	}
+	if (set) {
+		ops->set(gpio, set);
+	}
+}
+
+#endif /* RPI_GPIO_H */
@@ -5,6 +5,12 @@
 #include <linux/delay.h> /* msleep(), msleep(), mdelay() */
 #include <linux/workqueue.h> /* INIT_WORK() */
 
+#include "rpi_dht11.h"
+
+#define CREATE_TRACE_POINTS
+#define RPI_TRACE_LCD1602
+#include "rpi_trace.h"
+
 struct lcd1602
 {
 	struct device *dev;
@@ -14,6 +20,9 @@ struct lcd1602
 	struct gpio_desc *rs, *rw, *e;
 
 	struct work_struct work;
+
+	struct notifier_block nb; /* DHT11 frames */
+	struct device_node *sensor; /* DHT11 followed, "dht11" in DT, NULL for sysfs only */
 };
 
 #define LOW 0
@@ -21,6 +30,14 @@ struct lcd1602
 
 #define DRIVER_NAME "my_lcd1602"
 
+#define LCD1602_COLUMNS 16
+
+/* Frames outside the DHT11 range are dropped, not shown */
+#define LCD1602_TEMP_MIN 0
+#define LCD1602_TEMP_MAX 50
+#define LCD1602_HUM_MIN 0
+#define LCD1602_HUM_MAX 100
+
 static int Temperature = 0;
 static int Humidity = 0;
 
@@ -66,6 +83,35 @@ static ssize_t set_humidity(struct device *dev, struct device_attribute *attr, c
 }
 static DEVICE_ATTR(humidity, S_IWUSR, NULL, set_humidity);
 
+/* lcd1602_dht11_notify: Redraw only when a frame changes what is shown */
+static int lcd1602_dht11_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+	struct lcd1602 *lcd1602 = container_of(nb, struct lcd1602, nb);
+	const struct dht11_frame *frame = data;
+
+	if (!dht11_frame_from(frame, lcd1602->sensor)) {
+		return NOTIFY_OK;
+	}
+
+	if (frame->temperature < LCD1602_TEMP_MIN || frame->temperature > LCD1602_TEMP_MAX
+		|| frame->humidity < LCD1602_HUM_MIN || frame->humidity > LCD1602_HUM_MAX) {
+		dev_dbg(&lcd1602->pdev->dev, "[+] Ignoring frame %d %d\n", frame->temperature, frame->humidity);
+
+		return NOTIFY_OK;
+	}
+
+	if (frame->temperature == Temperature && frame->humidity == Humidity) {
+		return NOTIFY_OK;
+	}
+
+	Temperature = frame->temperature;
+	Humidity = frame->humidity;
+
+	schedule_work(&lcd1602->work);
+
+	return NOTIFY_OK;
+}
+
 static inline void __lcd1602_set_inst_value(struct platform_device *pdev,
 		unsigned rs_val, unsigned rw_val, unsigned e_val)
 {
@@ -80,6 +126,8 @@ static void lcd1602_write(struct platform_device *pdev, u8 val)
 {
 	struct lcd1602 *lcd1602 = platform_get_drvdata(pdev);
 
+	trace_lcd1602_xfer(HIGH, val);
+
 	__lcd1602_set_inst_value(pdev, HIGH, LOW, LOW); /* Data mode, Write mode */
 	udelay(1);
 
@@ -104,6 +152,8 @@ static void lcd1602_inst(struct platform_device *pdev, u8 val)
 {
 	struct lcd1602 *lcd1602 = platform_get_drvdata(pdev);
 
+	trace_lcd1602_xfer(LOW, val);
+
 	__lcd1602_set_inst_value(pdev, LOW, LOW, LOW); /* Inst mode, Write mode */
 	udelay(1);
 
@@ -134,13 +184,13 @@ static void lcd1602_puts(struct platform_device *pdev, char *ptr)
 static void lcd1602_work(struct work_struct *work)
 {
 	struct lcd1602 *lcd1602 = container_of(work, struct lcd1602, work);
+	char s1[LCD1602_COLUMNS + 1], s2[LCD1602_COLUMNS + 1];
 
-	dev_info(lcd1602->dev, "[+] lcd1602_work enter\n");
-
-	char s1[16], s2[16];
+	trace_lcd1602_work_begin(Temperature, Humidity);
 
-	sprintf(s1, "Temperature: %d", Temperature);
-	sprintf(s2, "Humidity: %d", Humidity);
+	/* Cut at the end of the line, whatever sysfs was given */
+	snprintf(s1, sizeof(s1), "Temperature: %d", Temperature);
+	snprintf(s2, sizeof(s2), "Humidity: %d", Humidity);
 
 	msleep(50);
 	lcd1602_inst(lcd1602->pdev, 0x01); /* Clear display */
@@ -151,7 +201,7 @@ static void lcd1602_work(struct work_struct *work)
 	lcd1602_inst(lcd1602->pdev, 0xc0); /* Move cursor position using DDRAM (40) */
 	lcd1602_puts(lcd1602->pdev, s2); /* Display string */
 
-	dev_info(lcd1602->dev, "[+] lcd1602_work exit\n");
+	trace_lcd1602_work_end(Temperature, Humidity);
 }
 
 static const struct of_device_id lcd1602_dt_ids[] = {
@@ -169,9 +219,13 @@ static int lcd1602_probe(struct platform_device *pdev)
 
 	dev_info(dev, "[+] lcd1602_probe enter");
 
-	lcd1602 = devm_kmalloc(dev, sizeof(struct lcd1602), GFP_KERNEL);
+	lcd1602 = devm_kzalloc(dev, sizeof(struct lcd1602), GFP_KERNEL); /* nb must start out zeroed */
 	lcd1602->dev = dev;
 	lcd1602->pdev = pdev;
+	lcd1602->sensor = dht11_sensor_get(dev);
+	if (IS_ERR(lcd1602->sensor)) {
+		return PTR_ERR(lcd1602->sensor);
+	}
 	lcd1602->d4 = devm_gpiod_get_index(dev, "lcd1602", 0, GPIOD_OUT_LOW); /* D4 */
 	lcd1602->d5 = devm_gpiod_get_index(dev, "lcd1602", 1, GPIOD_OUT_LOW); /* D5 */
 	lcd1602->d6 = devm_gpiod_get_index(dev, "lcd1602", 2, GPIOD_OUT_LOW); /* D6 */
@@ -209,6 +263,10 @@ static int lcd1602_probe(struct platform_device *pdev)
 		return ret;
 	}
 
+	/* Without a "dht11" phandle the frames are ignored */
+	lcd1602->nb.notifier_call = lcd1602_dht11_notify;
+	dht11_register_notifier(&lcd1602->nb);
+
 	dev_info(dev, "[+] lcd1602_probe exit");
 
 	return 0;
@@ -221,6 +279,9 @@ static int lcd1602_remove(struct platform_device *pdev)
 
 	dev_info(dev, "[+] lcd1602_remove enter");
 
+	dht11_unregister_notifier(&lcd1602->nb);
+	cancel_work_sync(&lcd1602->work);
+
 	device_remove_file(dev, &dev_attr_humidity);
 	device_remove_file(dev, &dev_attr_temperature);
 
@@ -1,110 +1,256 @@
 #include <linux/module.h>
 #include <linux/platform_device.h> /* platform_driver_register(), platform_set_drvdata() */
-#include <linux/io.h> /* ioremap(), iowrite32() */
 #include <linux/of.h> /* of_property_read_string() */
 #include <linux/miscdevice.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "rpi_dht11.h"
+#include "rpi_gpio.h"
+
+#define CREATE_TRACE_POINTS
+#define RPI_TRACE_LEDS
+#include "rpi_trace.h"
+
+/* Every DT node is a bank of red, yellow and green LEDs with its own pins
+ * and thresholds. One timer blinks all the banks, and with the mmio backend
+ * it lights and darkens all of them with one GPSET0 and one GPCLR0 write.
+ * A solid bank keeps its LED on instead, and is only written when its
+ * temperature changes. The timer only runs while a bank blinks.
+ */
+enum {
+	LED_RED,
+	LED_YELLOW,
+	LED_GREEN,
+	LED_COLOURS,
+};
 
 struct led_dev
 {
 	struct miscdevice led_misc_device; /* Assign device for each led */
 	const char * led_name; /* Stores "label" string */
-};
 
-#define BCM2710_PERI_BASE 0x3F000000
-#define GPIO_BASE (BCM2710_PERI_BASE + 0x200000) /* GPIO Controller */
+	struct list_head list; /* In Leds */
+	u32 pins[LED_COLOURS]; /* BCM numbers, "pins" in DT, only bits of the masks with gpiod and mock */
+	u32 thresholds[2]; /* Green up to the first, yellow up to the second, "thresholds" in DT */
+	struct device_node *sensor; /* DHT11 followed, "dht11" in DT, NULL for sysfs only */
+	struct rpi_gpio gpio;
+	int temperature;
+	bool on;
+	bool solid; /* "solid" in DT, or mode */
+};
 
 #define GPIO_17 17
 #define GPIO_27	27
 #define GPIO_22	22
 
-/* To set and clear each individual LED */
-#define GPIO_17_INDEX 1 << (GPIO_17 % 32)
-#define GPIO_27_INDEX 1 << (GPIO_27 % 32)
-#define GPIO_22_INDEX 1 << (GPIO_22 % 32)
-
-/* Select the output function */
-#define GPIO_17_FUNC 1 << ((GPIO_17 % 10) * 3)
-#define GPIO_27_FUNC 1 << ((GPIO_27 % 10) * 3)
-#define GPIO_22_FUNC 1 << ((GPIO_22 % 10) * 3)
-
-/* Mask the GPIO function */
-#define FSEL_17_MASK 0b111 << ((GPIO_17 % 10) * 3) /* Red since bit 21 (FSEL17) */
-#define FSEL_27_MASK 0b111 << ((GPIO_27 % 10) * 3) /* Yellow since bit 21 (FSEL27) */
-#define FSEL_22_MASK 0b111 << ((GPIO_22 % 10) * 3) /* Green since bit 6 (FSEL22) */
-
-#define GPIO_SET_FUNCTION_17_LED (GPIO_17_FUNC)
-#define GPIO_SET_FUNCTION_27_22_LEDS (GPIO_27_FUNC | GPIO_22_FUNC)
-#define GPIO_MASK_17_LED (FSEL_17_MASK)
-#define GPIO_MASK_27_22_LEDS (FSEL_27_MASK | FSEL_22_MASK)
-#define GPIO_SET_17_LED	(GPIO_17_INDEX)
-#define GPIO_SET_27_22_LEDS (GPIO_27_INDEX | GPIO_22_INDEX)
-
-#define GPIO_SET_FUNCTION_LEDS (GPIO_17_FUNC | GPIO_27_FUNC | GPIO_22_FUNC)
-#define GPIO_MASK_ALL_LEDS (FSEL_17_MASK | FSEL_27_MASK | FSEL_22_MASK)
-#define GPIO_SET_ALL_LEDS (GPIO_17_INDEX | GPIO_27_INDEX | GPIO_22_INDEX)
-
-#define GPFSEL1 GPIO_BASE + 0x04
-#define GPFSEL2	GPIO_BASE + 0x08
-#define GPSET0 GPIO_BASE + 0x1C
-#define GPCLR0 GPIO_BASE + 0x28
-
 #define CLASS_NAME "RYGleds_class"
 #define DEVICE_NAME "RYGleds_dev"
 
-/* Declear __iomem pointers that will keep virtual addresses */
-static void __iomem *GPFSEL1_V;
-static void __iomem *GPFSEL2_V;
-static void __iomem *GPSET0_V;
-static void __iomem *GPCLR0_V;
+static char *gpio_backend = "mmio";
+module_param(gpio_backend, charp, 0444);
+MODULE_PARM_DESC(gpio_backend, "mmio (BCM2837 registers), gpiod (led-gpios in DT, red, yellow, green) or mock");
+
+/* Without pins and thresholds in DT */
+static const u32 DefaultPins[LED_COLOURS] = { GPIO_17, GPIO_27, GPIO_22 };
+static const u32 DefaultThresholds[2] = { 25, 30 };
+
+static LIST_HEAD(Leds);
+static DEFINE_SPINLOCK(LedsLock); /* Leds and the state of every bank */
+
+static bool deferrable = true;
+module_param(deferrable, bool, 0444);
+MODULE_PARM_DESC(deferrable, "Blink on a deferrable timer that lets an idle CPU sleep through a period (default), 0 to blink exactly");
 
-static struct timer_list BlinkTimer;
+static struct timer_list BlinkTimer; /* Runs while a bank blinks */
+static bool BlinkArmed; /* BlinkTimer is pending, or running and about to rearm */
 static int BlinkPeriod = 500;
-static int Temperature = 0;
+
+/* Timer wakeups, per second over the last minute */
+#define WAKEUP_SECONDS 60
+static unsigned long WakeupSecond[WAKEUP_SECONDS]; /* jiffies / HZ counted in WakeupCount */
+static unsigned int WakeupCount[WAKEUP_SECONDS];
+static u64 Wakeups;
+static struct dentry *BlinkDebugfs;
 
 static struct class *RYGleds_class;
 static struct device *RYGleds_dev;
 dev_t dev;
 
-static void SetGPIOOutputValue(int temperature, bool outputValue)
+static u32 LedMask(const struct led_dev *led_device)
+{
+	return BIT(led_device->pins[LED_RED]) | BIT(led_device->pins[LED_YELLOW]) | BIT(led_device->pins[LED_GREEN]);
+}
+
+/* LedLit: The pins of led_device that are on in the on half of a blink */
+static u32 LedLit(const struct led_dev *led_device)
 {
+	int temperature = led_device->temperature;
+
 	if (temperature == 0) { /* Default - All leds is blinking */
-		if (outputValue) {
-			iowrite32(GPIO_SET_ALL_LEDS, GPSET0_V);
-		} else {
-			iowrite32(GPIO_SET_ALL_LEDS, GPCLR0_V);
-		}
-	} else { /* Operating */
-		if (temperature > 0 && temperature <= 25) { /* Green led is blinking */
-			if (outputValue) {
-				iowrite32(GPIO_22_INDEX, GPSET0_V);
-			} else {
-				iowrite32(GPIO_SET_ALL_LEDS, GPCLR0_V);
-			}
-		} else if (temperature > 25 && temperature <= 30) { /* Yellow led is blinking */
-			if (outputValue) {
-				iowrite32(GPIO_27_INDEX, GPSET0_V);
-			} else {
-				iowrite32(GPIO_SET_ALL_LEDS, GPCLR0_V);
-			}
-		} else if (temperature > 30) { /* Red led is blinking */
-			if (outputValue) {
-				iowrite32(GPIO_17_INDEX, GPSET0_V);
-			} else {
-				iowrite32(GPIO_SET_ALL_LEDS, GPCLR0_V);
-			}
+		return LedMask(led_device);
+	} else if (temperature < 0) {
+		return 0;
+	} else if (temperature <= led_device->thresholds[0]) { /* Green led is blinking */
+		return BIT(led_device->pins[LED_GREEN]);
+	} else if (temperature <= led_device->thresholds[1]) { /* Yellow led is blinking */
+		return BIT(led_device->pins[LED_YELLOW]);
+	} else { /* Red led is blinking */
+		return BIT(led_device->pins[LED_RED]);
+	}
+}
+
+/* LedSolid: Light the LED of a solid bank, with LedsLock held */
+static void LedSolid(struct led_dev *led_device)
+{
+	u32 lit = LedLit(led_device);
+
+	led_device->on = true;
+	rpi_gpio_write(&led_device->gpio, lit, LedMask(led_device) & ~lit);
+	trace_led_toggle(led_device->led_name, led_device->temperature, true);
+}
+
+static bool LedsBlinking(void)
+{
+	struct led_dev *led_device;
+
+	list_for_each_entry(led_device, &Leds, list) {
+		if (!led_device->solid) {
+			return true;
 		}
 	}
+
+	return false;
 }
 
+/* BlinkExpiry: The next multiple of the period, so every tick lands on the
+ * same jiffies as the whole second timers of round_jiffies() or between them
+ */
+static unsigned long BlinkExpiry(void)
+{
+	unsigned long period = msecs_to_jiffies(BlinkPeriod);
+
+	return roundup(jiffies + 1, period);
+}
+
+/* BlinkUpdate: Start the timer if a bank blinks, with LedsLock held */
+static void BlinkUpdate(void)
+{
+	if (!BlinkArmed && LedsBlinking()) {
+		BlinkArmed = true;
+		mod_timer(&BlinkTimer, BlinkExpiry());
+	}
+}
+
+static void CountWakeup(void)
+{
+	unsigned long second = jiffies / HZ;
+	unsigned int i = second % WAKEUP_SECONDS;
+
+	if (WakeupSecond[i] != second) {
+		WakeupSecond[i] = second;
+		WakeupCount[i] = 0;
+	}
+	++WakeupCount[i];
+	++Wakeups;
+}
+
+/* BlinkTimerHandler: Toggle every blinking bank, then write the pins. Banks
+ * on a backend with shared registers are gathered into one set and one clear.
+ */
 static void BlinkTimerHandler(unsigned long unused)
 {
-	static bool on = false;
+	struct led_dev *led_device;
+	struct rpi_gpio *shared = NULL;
+	u32 set = 0, clear = 0, lit;
+	unsigned long flags;
+
+	spin_lock_irqsave(&LedsLock, flags);
+
+	CountWakeup();
+
+	list_for_each_entry(led_device, &Leds, list) {
+		if (led_device->solid) {
+			continue;
+		}
+
+		led_device->on = !led_device->on;
+		lit = led_device->on ? LedLit(led_device) : 0;
+		trace_led_toggle(led_device->led_name, led_device->temperature, led_device->on);
 
-	on = !on;
+		if (!READ_ONCE(led_device->gpio.ops)->shared) {
+			rpi_gpio_write(&led_device->gpio, lit, LedMask(led_device) & ~lit);
+			continue;
+		}
 
-	SetGPIOOutputValue(Temperature, on);
+		if (!shared) {
+			shared = &led_device->gpio;
+		}
+		set |= lit;
+		clear |= LedMask(led_device) & ~lit;
+	}
 
-	mod_timer(&BlinkTimer, jiffies + msecs_to_jiffies(BlinkPeriod));
+	if (shared) {
+		rpi_gpio_write(shared, set, clear);
+	}
+
+	/* Nothing blinks any more, stay off until BlinkUpdate() */
+	if (LedsBlinking()) {
+		mod_timer(&BlinkTimer, BlinkExpiry());
+	} else {
+		BlinkArmed = false;
+	}
+
+	spin_unlock_irqrestore(&LedsLock, flags);
+}
+
+/* LedSetTemperature: A blinking bank picks it up on its next period, with LedsLock held */
+static void LedSetTemperature(struct led_dev *led_device, int temperature)
+{
+	if (led_device->temperature == temperature) {
+		return;
+	}
+
+	led_device->temperature = temperature;
+	if (led_device->solid) {
+		LedSolid(led_device);
+	}
+}
+
+/* LedSetSolid: With LedsLock held, BlinkUpdate() after it */
+static void LedSetSolid(struct led_dev *led_device, bool solid)
+{
+	led_device->solid = solid;
+	if (solid) {
+		LedSolid(led_device);
+	}
+}
+
+/* SetTemperature: Of every bank */
+static void SetTemperature(int temperature)
+{
+	struct led_dev *led_device;
+	unsigned long flags;
+
+	spin_lock_irqsave(&LedsLock, flags);
+	list_for_each_entry(led_device, &Leds, list) {
+		LedSetTemperature(led_device, temperature);
+	}
+	spin_unlock_irqrestore(&LedsLock, flags);
+}
+
+/* ParseMode: "blink" or "solid" */
+static int ParseMode(const char *buf, bool *solid)
+{
+	if (sysfs_streq(buf, "blink")) {
+		*solid = false;
+	} else if (sysfs_streq(buf, "solid")) {
+		*solid = true;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
 }
 
 static ssize_t set_temperature(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
@@ -117,7 +263,7 @@ static ssize_t set_temperature(struct device *dev, struct device_attribute *attr
 		return -EINVAL;
 	}
 
-	Temperature = temperature_value;
+	SetTemperature(temperature_value);
 
 	pr_info("[+] set_temperature exit\n");
 
@@ -125,26 +271,259 @@ static ssize_t set_temperature(struct device *dev, struct device_attribute *attr
 }
 static DEVICE_ATTR(temperature, S_IWUSR, NULL, set_temperature);
 
-static int __init led_probe(struct platform_device *pdev)
+/* set_mode: Of every bank */
+static ssize_t set_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct led_dev *led_device;
+	unsigned long flags;
+	bool solid;
+
+	if (ParseMode(buf, &solid)) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&LedsLock, flags);
+	list_for_each_entry(led_device, &Leds, list) {
+		LedSetSolid(led_device, solid);
+	}
+	BlinkUpdate();
+	spin_unlock_irqrestore(&LedsLock, flags);
+
+	return count;
+}
+static DEVICE_ATTR(mode, S_IWUSR, NULL, set_mode);
+
+static struct device_attribute *RYGledsAttrs[] = {
+	&dev_attr_temperature,
+	&dev_attr_mode,
+};
+
+/* set_led_temperature: temperature of the misc device, for one bank only */
+static ssize_t set_led_temperature(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct led_dev *led_device = container_of(misc, struct led_dev, led_misc_device);
+	long temperature_value = 0;
+	unsigned long flags;
+
+	if (kstrtol(buf, 10, &temperature_value) < 0) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&LedsLock, flags);
+	LedSetTemperature(led_device, temperature_value);
+	spin_unlock_irqrestore(&LedsLock, flags);
+
+	return count;
+}
+
+static struct device_attribute dev_attr_led_temperature = __ATTR(temperature, S_IWUSR, NULL, set_led_temperature);
+
+/* set_led_mode: mode of the misc device, for one bank only */
+static ssize_t set_led_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct led_dev *led_device = container_of(misc, struct led_dev, led_misc_device);
+	unsigned long flags;
+	bool solid;
+
+	if (ParseMode(buf, &solid)) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&LedsLock, flags);
+	LedSetSolid(led_device, solid);
+	BlinkUpdate();
+	spin_unlock_irqrestore(&LedsLock, flags);
+
+	return count;
+}
+
+static struct device_attribute dev_attr_led_mode = __ATTR(mode, S_IWUSR, NULL, set_led_mode);
+
+static struct attribute *led_attrs[] = {
+	&dev_attr_led_temperature.attr,
+	&dev_attr_led_mode.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(led);
+
+/* BlinkStatsShow: For checking the wakeups against powertop */
+static int BlinkStatsShow(struct seq_file *s, void *unused)
+{
+	unsigned long second, flags;
+	unsigned int i, per_minute = 0;
+	bool armed;
+	u64 wakeups;
+
+	spin_lock_irqsave(&LedsLock, flags);
+	second = jiffies / HZ;
+	for (i = 0; i < WAKEUP_SECONDS; ++i) {
+		if (second - WakeupSecond[i] < WAKEUP_SECONDS) {
+			per_minute += WakeupCount[i];
+		}
+	}
+	wakeups = Wakeups;
+	armed = BlinkArmed;
+	spin_unlock_irqrestore(&LedsLock, flags);
+
+	seq_printf(s, "wakeups_per_minute %u\n", per_minute);
+	seq_printf(s, "wakeups %llu\n", wakeups);
+	seq_printf(s, "timer %s%s\n", armed ? "on" : "off", armed && deferrable ? " deferrable" : "");
+
+	return 0;
+}
+
+static int BlinkStatsOpen(struct inode *inode, struct file *file)
+{
+	return single_open(file, BlinkStatsShow, inode->i_private);
+}
+
+static const struct file_operations BlinkStatsFops = {
+	.owner = THIS_MODULE,
+	.open = BlinkStatsOpen,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Dht11FrameNotify: Follow the sensors directly, each bank its own */
+static int Dht11FrameNotify(struct notifier_block *nb, unsigned long event, void *data)
+{
+	const struct dht11_frame *frame = data;
+	struct led_dev *led_device;
+	unsigned long flags;
+
+	spin_lock_irqsave(&LedsLock, flags);
+	list_for_each_entry(led_device, &Leds, list) {
+		if (dht11_frame_from(frame, led_device->sensor)) {
+			LedSetTemperature(led_device, frame->temperature);
+		}
+	}
+	spin_unlock_irqrestore(&LedsLock, flags);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block Dht11Notifier = {
+	.notifier_call = Dht11FrameNotify,
+};
+
+/* led_parse: "pins" = <red yellow green>, "thresholds" = <green yellow>, "solid" and "dht11", all optional */
+static int led_parse(struct platform_device *pdev, struct led_dev *led_device)
+{
+	struct device_node *np = pdev->dev.of_node;
+	unsigned int i;
+	int ret_val;
+
+	memcpy(led_device->pins, DefaultPins, sizeof(DefaultPins));
+	memcpy(led_device->thresholds, DefaultThresholds, sizeof(DefaultThresholds));
+
+	ret_val = of_property_read_u32_array(np, "pins", led_device->pins, LED_COLOURS);
+	if (ret_val && ret_val != -EINVAL) {
+		dev_err(&pdev->dev, "[+] pins needs %d BCM numbers\n", LED_COLOURS);
+
+		return ret_val;
+	}
+	for (i = 0; i < LED_COLOURS; ++i) {
+		if (led_device->pins[i] >= 32) {
+			dev_err(&pdev->dev, "[+] GPIO %u isn't in the first bank\n", led_device->pins[i]);
+
+			return -EINVAL;
+		}
+	}
+
+	ret_val = of_property_read_u32_array(np, "thresholds", led_device->thresholds, 2);
+	if ((ret_val && ret_val != -EINVAL) || led_device->thresholds[0] > led_device->thresholds[1]) {
+		dev_err(&pdev->dev, "[+] thresholds needs the green and yellow maximum, in order\n");
+
+		return -EINVAL;
+	}
+
+	led_device->solid = of_property_read_bool(np, "solid");
+
+	led_device->sensor = dht11_sensor_get(&pdev->dev);
+	if (IS_ERR(led_device->sensor)) {
+		return PTR_ERR(led_device->sensor);
+	}
+
+	return 0;
+}
+
+static int __init led_probe(struct platform_device *pdev)
+{
+	struct led_dev *led_device, *other;
+	const struct rpi_gpio_ops *ops;
+	unsigned long flags;
 	int ret_val;
 
 	pr_info("[+] led_probe enter\n");
 
 	led_device = devm_kzalloc(&pdev->dev, sizeof(struct led_dev), GFP_KERNEL);
+	if (!led_device) {
+		return -ENOMEM;
+	}
 
-	of_property_read_string(pdev->dev.of_node, "label", &led_device->led_name);
+	ret_val = led_parse(pdev, led_device);
+	if (ret_val) {
+		return ret_val;
+	}
+
+	if (of_property_read_string(pdev->dev.of_node, "label", &led_device->led_name)) {
+		led_device->led_name = dev_name(&pdev->dev);
+	}
 	led_device->led_misc_device.minor = MISC_DYNAMIC_MINOR;
 	led_device->led_misc_device.name = led_device->led_name;
+	led_device->led_misc_device.parent = &pdev->dev;
+	led_device->led_misc_device.groups = led_groups;
+
+	led_device->gpio.name = led_device->led_name;
+	led_device->gpio.con_id = "led";
+	led_device->gpio.pins = led_device->pins;
+	led_device->gpio.num_pins = LED_COLOURS;
+
+	/* Banks share the GPIO registers, not the pins. Other backends take
+	 * their own led-gpios, pins are then only the bits of the masks.
+	 */
+	ops = rpi_gpio_backend(gpio_backend);
+	if (ops && ops->shared) {
+		spin_lock_irqsave(&LedsLock, flags);
+		list_for_each_entry(other, &Leds, list) {
+			if (LedMask(other) & LedMask(led_device)) {
+				ret_val = -EBUSY;
+			}
+		}
+		spin_unlock_irqrestore(&LedsLock, flags);
+		if (ret_val) {
+			dev_err(&pdev->dev, "[+] Pins already used by another bank\n");
+
+			return ret_val;
+		}
+	}
+
+	ret_val = rpi_gpio_init(&led_device->gpio, &pdev->dev, gpio_backend);
+	if (ret_val) {
+		return ret_val;
+	}
 
 	ret_val = misc_register(&led_device->led_misc_device);
 	if (ret_val) {
+		rpi_gpio_exit(&led_device->gpio);
+
 		return ret_val;
 	}
 
 	platform_set_drvdata(pdev, led_device);
 
+	/* The timer stops on its own once no bank blinks */
+	spin_lock_irqsave(&LedsLock, flags);
+	list_add_tail(&led_device->list, &Leds);
+	if (led_device->solid) {
+		LedSolid(led_device);
+	}
+	BlinkUpdate();
+	spin_unlock_irqrestore(&LedsLock, flags);
+
 	pr_info("[+] led_probe exit\n");
 
 	return 0;
@@ -153,11 +532,19 @@ static int __init led_probe(struct platform_device *pdev)
 static int __exit led_remove(struct platform_device *pdev)
 {
 	struct led_dev *led_device = platform_get_drvdata(pdev);
+	unsigned long flags;
 
 	pr_info("[+] led_remove enter\n");
 
+	/* The timer only reaches a bank through Leds */
+	spin_lock_irqsave(&LedsLock, flags);
+	list_del(&led_device->list);
+	spin_unlock_irqrestore(&LedsLock, flags);
+
 	misc_deregister(&led_device->led_misc_device);
 
+	rpi_gpio_exit(&led_device->gpio); /* Clear all the leds */
+
 	pr_info("[+] led_remove exit\n");
 
 	return 0;
@@ -182,12 +569,19 @@ static struct platform_driver led_platform_driver = {
 static int RYGleds_init(void)
 {
 	int ret_val;
-	u32 GPFSEL_read, GPFSEL_write;
 	dev_t dev_no;
 	int Major;
+	size_t i;
 
 	pr_info("[+] RYGleds_init enter\n");
 
+	/* led_probe() starts it once a bank is ready */
+	if (deferrable) {
+		setup_deferrable_timer(&BlinkTimer, BlinkTimerHandler, 0);
+	} else {
+		setup_timer(&BlinkTimer, BlinkTimerHandler, 0);
+	}
+
 	ret_val = platform_driver_register(&led_platform_driver);
 	if (ret_val != 0) {
 		pr_err("[+] Platform value returned %d\n", ret_val);
@@ -195,29 +589,6 @@ static int RYGleds_init(void)
 		return ret_val;
 	}
 
-	GPFSEL1_V = ioremap(GPFSEL1, sizeof(u32));
-	GPFSEL2_V = ioremap(GPFSEL2, sizeof(u32));
-	GPSET0_V = ioremap(GPSET0, sizeof(u32));
-	GPCLR0_V = ioremap(GPCLR0, sizeof(u32));
-
-	GPFSEL_read = ioread32(GPFSEL1_V); /* Read current value */
-	/* Set to 0 3 bits of each FSEL and keep equal the rest of bits,
-	 * then set to 1 the first bit of each FSEL (function) to set 3 GPIOS to output.
-	 */
-	GPFSEL_write = (GPFSEL_read & ~GPIO_MASK_17_LED)
-			| (GPIO_SET_FUNCTION_17_LED & GPIO_MASK_17_LED);
-	iowrite32(GPFSEL_write, GPFSEL1_V); /* Set leds to output */
-
-	GPFSEL_read = ioread32(GPFSEL2_V); /* Read current value */
-	/* Set to 0 3 bits of each FSEL and keep equal the rest of bits,
-	 * then set to 1 the first bit of each FSEL (function) to set 3 GPIOS to output.
-	 */
-	GPFSEL_write = (GPFSEL_read & ~GPIO_MASK_27_22_LEDS)
-			| (GPIO_SET_FUNCTION_27_22_LEDS & GPIO_MASK_27_22_LEDS);
-	iowrite32(GPFSEL_write, GPFSEL2_V); /* Set leds to output */
-
-	iowrite32(GPIO_SET_ALL_LEDS, GPCLR0_V); /* Clear all the leds, output is low */
-
 	/* Allocate dynamically device numbers */
 	ret_val = alloc_chrdev_region(&dev_no, 0, 1, DEVICE_NAME);
 	if (ret_val < 0) {
@@ -254,15 +625,20 @@ static int RYGleds_init(void)
 	}
 	pr_info("[+] The device is created correctly\n");
 
-	ret_val = device_create_file(RYGleds_dev, &dev_attr_temperature);
-	if (ret_val != 0) {
-		dev_err(RYGleds_dev, "[+] Failed to create sysfs entry");
+	for (i = 0; i < ARRAY_SIZE(RYGledsAttrs); ++i) {
+		ret_val = device_create_file(RYGleds_dev, RYGledsAttrs[i]);
+		if (ret_val != 0) {
+			dev_err(RYGleds_dev, "[+] Failed to create sysfs entry");
 
-		return ret_val;
+			return ret_val;
+		}
 	}
 
-	setup_timer(&BlinkTimer, BlinkTimerHandler, 0);
-	ret_val = mod_timer(&BlinkTimer, jiffies + msecs_to_jiffies(BlinkPeriod));
+	BlinkDebugfs = debugfs_create_dir("RYGleds_blink", NULL);
+	debugfs_create_file("stats", S_IRUSR, BlinkDebugfs, NULL, &BlinkStatsFops);
+
+	/* Banks without a "dht11" phandle ignore the frames */
+	dht11_register_notifier(&Dht11Notifier);
 
 	pr_info("[+] RYGleds_init exit\n");
 
@@ -271,24 +647,23 @@ static int RYGleds_init(void)
 
 static void RYGleds_exit(void)
 {
+	size_t i;
+
 	pr_info("[+] RYGleds_exit enter\n");
 
-	del_timer(&BlinkTimer);
+	dht11_unregister_notifier(&Dht11Notifier);
 
-	device_remove_file(RYGleds_dev, &dev_attr_temperature);
+	for (i = 0; i < ARRAY_SIZE(RYGledsAttrs); ++i) {
+		device_remove_file(RYGleds_dev, RYGledsAttrs[i]);
+	}
+	debugfs_remove_recursive(BlinkDebugfs);
 
 	device_destroy(RYGleds_class, dev); /* Remove the device */
 	class_destroy(RYGleds_class); /* Remove the device class */
 	unregister_chrdev_region(dev, 1); /* Unregister the device numbers */
 
-	iowrite32(GPIO_SET_ALL_LEDS, GPCLR0_V); /* Clear all the leds */
-
-	iounmap(GPFSEL1_V);
-	iounmap(GPFSEL2_V);
-	iounmap(GPSET0_V);
-	iounmap(GPCLR0_V);
-
-	platform_driver_unregister(&led_platform_driver);
+	platform_driver_unregister(&led_platform_driver); /* led_remove() clears the leds */
+	del_timer_sync(&BlinkTimer); /* Fires at most once more, with no banks */
 
 	pr_info("[+] RYGleds_exit exit\n");
 }
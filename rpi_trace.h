@@ -0,0 +1,173 @@
+/*
+ * Trace events for the DHT11, LEDs, buzzer and LCD1602 drivers
+ *
+ * All events share one system, so the whole path from the sensor to the
+ * sinks is enabled at once:
+ *   echo 1 > /sys/kernel/debug/tracing/events/rpi/enable
+ *   perf record -e 'rpi:*' -a
+ *
+ * A driver defines CREATE_TRACE_POINTS and its RPI_TRACE_<DRIVER> before
+ * including this file, so every module only instantiates its own events.
+ * TRACE_INCLUDE_PATH is ".", the module build has to add the directory of
+ * this file to the include path (ccflags-y += -I$(src)).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rpi
+
+#if !defined(RPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define RPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#ifdef RPI_TRACE_DHT11
+/* dht11_start: Start pulse, the line is pulled low now */
+TRACE_EVENT(dht11_start,
+	TP_PROTO(int gpio, bool polling),
+	TP_ARGS(gpio, polling),
+	TP_STRUCT__entry(
+		__field(int, gpio)
+		__field(bool, polling)
+	),
+	TP_fast_assign(
+		__entry->gpio = gpio;
+		__entry->polling = polling;
+	),
+	TP_printk("gpio=%d mode=%s", __entry->gpio, __entry->polling ? "poll" : "irq")
+);
+
+/* dht11_edge: Edge n captured by the IRQ handler, delta ns after edge n - 1 */
+TRACE_EVENT(dht11_edge,
+	TP_PROTO(int gpio, int n, int value, u32 delta),
+	TP_ARGS(gpio, n, value, delta),
+	TP_STRUCT__entry(
+		__field(int, gpio)
+		__field(int, n)
+		__field(int, value)
+		__field(u32, delta)
+	),
+	TP_fast_assign(
+		__entry->gpio = gpio;
+		__entry->n = n;
+		__entry->value = value;
+		__entry->delta = delta;
+	),
+	TP_printk("gpio=%d n=%d %s delta=%uns", __entry->gpio, __entry->n, __entry->value ? "high" : "low", __entry->delta)
+);
+
+/* dht11_decode: End of a transaction, temperature and humidity are only valid if result is 0 */
+TRACE_EVENT(dht11_decode,
+	TP_PROTO(int gpio, int result, int num_edges, int offset, u32 threshold, int temperature, int humidity),
+	TP_ARGS(gpio, result, num_edges, offset, threshold, temperature, humidity),
+	TP_STRUCT__entry(
+		__field(int, gpio)
+		__field(int, result)
+		__field(int, num_edges)
+		__field(int, offset)
+		__field(u32, threshold)
+		__field(int, temperature)
+		__field(int, humidity)
+	),
+	TP_fast_assign(
+		__entry->gpio = gpio;
+		__entry->result = result;
+		__entry->num_edges = num_edges;
+		__entry->offset = offset;
+		__entry->threshold = threshold;
+		__entry->temperature = temperature;
+		__entry->humidity = humidity;
+	),
+	TP_printk("gpio=%d result=%d edges=%d offset=%d threshold=%uns temperature=%d humidity=%d",
+		__entry->gpio, __entry->result, __entry->num_edges, __entry->offset, __entry->threshold,
+		__entry->temperature, __entry->humidity)
+);
+#endif /* RPI_TRACE_DHT11 */
+
+#ifdef RPI_TRACE_LEDS
+/* led_toggle: A bank on each BlinkTimerHandler() period, or a solid one whose LED changes */
+TRACE_EVENT(led_toggle,
+	TP_PROTO(const char *label, int temperature, bool on),
+	TP_ARGS(label, temperature, on),
+	TP_STRUCT__entry(
+		__string(label, label)
+		__field(int, temperature)
+		__field(bool, on)
+	),
+	TP_fast_assign(
+		__assign_str(label, label);
+		__entry->temperature = temperature;
+		__entry->on = on;
+	),
+	TP_printk("%s temperature=%d %s", __get_str(label), __entry->temperature, __entry->on ? "on" : "off")
+);
+#endif /* RPI_TRACE_LEDS */
+
+#ifdef RPI_TRACE_BUZZER
+/* buzzer_pulse: One period of the buzzer square wave */
+TRACE_EVENT(buzzer_pulse,
+	TP_PROTO(int temperature),
+	TP_ARGS(temperature),
+	TP_STRUCT__entry(
+		__field(int, temperature)
+	),
+	TP_fast_assign(
+		__entry->temperature = temperature;
+	),
+	TP_printk("temperature=%d", __entry->temperature)
+);
+#endif /* RPI_TRACE_BUZZER */
+
+#ifdef RPI_TRACE_LCD1602
+DECLARE_EVENT_CLASS(lcd1602_work_class,
+	TP_PROTO(int temperature, int humidity),
+	TP_ARGS(temperature, humidity),
+	TP_STRUCT__entry(
+		__field(int, temperature)
+		__field(int, humidity)
+	),
+	TP_fast_assign(
+		__entry->temperature = temperature;
+		__entry->humidity = humidity;
+	),
+	TP_printk("temperature=%d humidity=%d", __entry->temperature, __entry->humidity)
+);
+
+/* lcd1602_work_begin/end: One refresh of both lines */
+DEFINE_EVENT(lcd1602_work_class, lcd1602_work_begin,
+	TP_PROTO(int temperature, int humidity),
+	TP_ARGS(temperature, humidity)
+);
+
+DEFINE_EVENT(lcd1602_work_class, lcd1602_work_end,
+	TP_PROTO(int temperature, int humidity),
+	TP_ARGS(temperature, humidity)
+);
+
+/* lcd1602_xfer: One byte written in two nibbles, rs is 0 for instructions and 1 for data */
+TRACE_EVENT(lcd1602_xfer,
+	TP_PROTO(int rs, u8 val),
+	TP_ARGS(rs, val),
+	TP_STRUCT__entry(
+		__field(int, rs)
+		__field(u8, val)
+	),
+	TP_fast_assign(
+		__entry->rs = rs;
+		__entry->val = val;
+	),
+	TP_printk("%s 0x%02x", __entry->rs ? "data" : "inst", __entry->val)
+);
+#endif /* RPI_TRACE_LCD1602 */
+
+#endif /* RPI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rpi_trace
+#include <trace/define_trace.h>